@@ -0,0 +1,240 @@
+#include "bvh.h"
+
+#include <cfloat>
+#include <cstdio>
+#include <utility>
+
+
+static const uint32_t bin_count = 12;
+
+
+struct Bounds
+{
+	float bmin[3];
+	float bmax[3];
+};
+
+static void
+reset_bounds(Bounds* b)
+{
+	for(int i = 0; i < 3; i++)
+	{
+		b->bmin[i] = FLT_MAX;
+		b->bmax[i] = -FLT_MAX;
+	}
+}
+
+static void
+grow_bounds(Bounds* b, const Bounds& other)
+{
+	for(int i = 0; i < 3; i++)
+	{
+		b->bmin[i] = other.bmin[i] < b->bmin[i] ? other.bmin[i] : b->bmin[i];
+		b->bmax[i] = other.bmax[i] > b->bmax[i] ? other.bmax[i] : b->bmax[i];
+	}
+}
+
+static float
+surface_area(const Bounds& b)
+{
+	if(b.bmin[0] > b.bmax[0])
+		return 0.0f;
+
+	const float dx = b.bmax[0] - b.bmin[0];
+	const float dy = b.bmax[1] - b.bmin[1];
+	const float dz = b.bmax[2] - b.bmin[2];
+	return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+
+struct BuildPrim
+{
+	Bounds bounds;
+	float centroid[3];
+	uint32_t sphere_idx;
+};
+
+struct Builder
+{
+	std::vector<BuildPrim> prim_vec;
+	std::vector<BvhNode>* node_vec;
+	uint32_t leaf_size;
+};
+
+static void
+make_leaf(BvhNode* node, uint32_t first, uint32_t count)
+{
+	node->left_first = first;
+	node->count = count;
+}
+
+//binned sah over the centroids, falls back to a median split when every centroid lands in one bin
+static void
+build_node(Builder* builder, uint32_t node_idx, uint32_t first, uint32_t count, uint32_t depth)
+{
+	std::vector<BuildPrim>& prims = builder->prim_vec;
+
+	Bounds bounds, centroid_bounds;
+	reset_bounds(&bounds);
+	reset_bounds(&centroid_bounds);
+	for(uint32_t i = first; i < first + count; i++)
+	{
+		grow_bounds(&bounds, prims[i].bounds);
+		Bounds c;
+		for(int a = 0; a < 3; a++)
+		{
+			c.bmin[a] = prims[i].centroid[a];
+			c.bmax[a] = prims[i].centroid[a];
+		}
+		grow_bounds(&centroid_bounds, c);
+	}
+
+	BvhNode& node = (*builder->node_vec)[node_idx];
+	for(int a = 0; a < 3; a++)
+	{
+		node.bmin[a] = bounds.bmin[a];
+		node.bmax[a] = bounds.bmax[a];
+	}
+
+	if(count <= builder->leaf_size || depth >= bvh_max_depth)
+	{
+		make_leaf(&node, first, count);
+		return;
+	}
+
+
+	int best_axis = -1;
+	uint32_t best_split = 0;
+	float best_cost = FLT_MAX;
+	for(int a = 0; a < 3; a++)
+	{
+		const float extent = centroid_bounds.bmax[a] - centroid_bounds.bmin[a];
+		if(extent <= 0.0f)
+			continue;
+
+		Bounds bin_bounds[bin_count];
+		uint32_t bin_prims[bin_count] = {};
+		for(uint32_t b = 0; b < bin_count; b++)
+			reset_bounds(&bin_bounds[b]);
+
+		const float scale = bin_count / extent;
+		for(uint32_t i = first; i < first + count; i++)
+		{
+			uint32_t b = (uint32_t)((prims[i].centroid[a] - centroid_bounds.bmin[a]) * scale);
+			b = b < bin_count ? b : bin_count - 1;
+			grow_bounds(&bin_bounds[b], prims[i].bounds);
+			bin_prims[b]++;
+		}
+
+		//sweep from the right to get the cost of every split plane in one pass each way
+		float right_area[bin_count];
+		uint32_t right_prims[bin_count];
+		Bounds right;
+		reset_bounds(&right);
+		uint32_t right_count = 0;
+		for(uint32_t b = bin_count - 1; b > 0; b--)
+		{
+			grow_bounds(&right, bin_bounds[b]);
+			right_count += bin_prims[b];
+			right_area[b] = surface_area(right);
+			right_prims[b] = right_count;
+		}
+
+		Bounds left;
+		reset_bounds(&left);
+		uint32_t left_count = 0;
+		for(uint32_t b = 1; b < bin_count; b++)
+		{
+			grow_bounds(&left, bin_bounds[b - 1]);
+			left_count += bin_prims[b - 1];
+			if(left_count == 0 || right_prims[b] == 0)
+				continue;
+
+			const float cost = surface_area(left) * left_count + right_area[b] * right_prims[b];
+			if(cost < best_cost)
+			{
+				best_cost = cost;
+				best_axis = a;
+				best_split = b;
+			}
+		}
+	}
+
+	uint32_t mid = first;
+	if(best_axis >= 0 && best_cost < surface_area(bounds) * count)
+	{
+		const float extent = centroid_bounds.bmax[best_axis] - centroid_bounds.bmin[best_axis];
+		const float scale = bin_count / extent;
+		uint32_t i = first;
+		uint32_t j = first + count;
+		while(i < j)
+		{
+			uint32_t b = (uint32_t)((prims[i].centroid[best_axis] - centroid_bounds.bmin[best_axis]) * scale);
+			b = b < bin_count ? b : bin_count - 1;
+			if(b < best_split)
+				i++;
+			else
+				std::swap(prims[i], prims[--j]);
+		}
+		mid = i;
+	}
+	else if(count > builder->leaf_size * 4)
+	{
+		//splitting doesn't pay off by sah, but a huge leaf would still be a linear scan on the gpu
+		mid = first + count / 2;
+	}
+	else
+	{
+		make_leaf(&node, first, count);
+		return;
+	}
+
+	//children are allocated as a pair, so node can't be used after this
+	const uint32_t left_idx = (uint32_t)builder->node_vec->size();
+	builder->node_vec->resize(left_idx + 2);
+	(*builder->node_vec)[node_idx].left_first = left_idx;
+	(*builder->node_vec)[node_idx].count = 0;
+
+	build_node(builder, left_idx, first, mid - first, depth + 1);
+	build_node(builder, left_idx + 1, mid, first + count - mid, depth + 1);
+}
+
+
+bool
+build_bvh(std::vector<Sphere>* sphere_vec, std::vector<BvhNode>* node_vec, uint32_t leaf_size)
+{
+	if(sphere_vec->empty())
+	{
+		fprintf(stderr, "can't build a bvh over an empty scene!\n");
+		return false;
+	}
+
+	Builder builder;
+	builder.node_vec = node_vec;
+	builder.leaf_size = leaf_size > 0 ? leaf_size : 1;
+	builder.prim_vec.resize(sphere_vec->size());
+	for(uint32_t i = 0; i < sphere_vec->size(); i++)
+	{
+		const Sphere& s = (*sphere_vec)[i];
+		BuildPrim& p = builder.prim_vec[i];
+		for(int a = 0; a < 3; a++)
+		{
+			p.bounds.bmin[a] = s.center[a] - s.radius;
+			p.bounds.bmax[a] = s.center[a] + s.radius;
+			p.centroid[a] = s.center[a];
+		}
+		p.sphere_idx = i;
+	}
+
+	node_vec->clear();
+	node_vec->reserve(2 * sphere_vec->size());
+	node_vec->resize(1);
+	build_node(&builder, 0, 0, (uint32_t)sphere_vec->size(), 0);
+
+	std::vector<Sphere> sorted_vec;
+	sorted_vec.reserve(sphere_vec->size());
+	for(const BuildPrim& p : builder.prim_vec)
+		sorted_vec.push_back((*sphere_vec)[p.sphere_idx]);
+	sphere_vec->swap(sorted_vec);
+	return true;
+}
\ No newline at end of file
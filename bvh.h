@@ -0,0 +1,26 @@
+#pragma once
+#include "scene.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+//32 bytes, matches BvhNode in common.glsl
+//children of an interior node are always stored next to each other, so one index addresses both
+struct BvhNode
+{
+	float bmin[3];
+	uint32_t left_first; //left child for interior nodes, first sphere for leaves
+	float bmax[3];
+	uint32_t count; //0 for interior nodes, number of spheres for leaves
+};
+
+//the restart trail in the traversal kernel keeps one bit per level
+constexpr uint32_t bvh_max_depth = 31;
+
+//leaves are made once a node has this many spheres or fewer
+constexpr uint32_t default_bvh_leaf_size = 4;
+
+//reorders the spheres so every leaf covers a contiguous range of them, node 0 is the root
+//a bigger leaf_size makes a shallower tree with bigger leaves, for when a whole leaf is tested at once
+bool build_bvh(std::vector<Sphere>* sphere_vec, std::vector<BvhNode>* node_vec, uint32_t leaf_size = default_bvh_leaf_size);
\ No newline at end of file
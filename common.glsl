@@ -0,0 +1,332 @@
+//shared by every kernel, the host side of these is in render.h and scene.h
+//the workgroup size, bounce count and material paths are specialized per device and scene, see KernelVariant
+layout(local_size_x_id = 0, local_size_y_id = 1, local_size_z = 1) in;
+
+layout(constant_id = 2) const uint MAX_BOUNCES = 8u;
+layout(constant_id = 3) const bool USE_METAL = true;
+layout(constant_id = 4) const bool USE_DIELECTRIC = true;
+
+#define MATERIAL_DIFFUSE 0u
+#define MATERIAL_METAL 1u
+#define MATERIAL_DIELECTRIC 2u
+
+#define T_MIN 0.001
+#define T_MAX 1e30
+
+struct Sphere
+{
+	vec3 center;
+	float radius;
+	vec3 albedo;
+	uint material;
+	vec3 emission;
+	float param;
+};
+
+layout(std140, set = 0, binding = 0) uniform Params
+{
+	uint width;
+	uint height;
+	uint sphere_count;
+	uint light_count;
+	uint path_capacity;
+} params;
+
+//per dispatch values, recorded straight into the command buffer
+layout(push_constant) uniform PushConstants
+{
+	vec4 cam_origin;
+	vec4 cam_lower_left;
+	vec4 cam_horizontal;
+	vec4 cam_vertical;
+	uint sample_idx;
+	uint seed;
+	uvec2 tile_origin;
+	uint stats_slot;
+	uint bounce;
+	uvec2 tile_size;
+	uint path_count;
+} pc;
+
+layout(std430, set = 0, binding = 1) readonly buffer SphereBuffer
+{
+	Sphere spheres[];
+};
+
+//children of an interior node are adjacent, a leaf covers spheres [left_first, left_first + count)
+struct BvhNode
+{
+	vec3 bmin;
+	uint left_first;
+	vec3 bmax;
+	uint count;
+};
+
+layout(std430, set = 0, binding = 10) readonly buffer BvhBuffer
+{
+	BvhNode nodes[];
+};
+
+//center in xyz and radius in w of every sphere, in the same order as spheres[]
+//traversal only reads these, 16 bytes a sphere instead of the whole 48 byte Sphere
+layout(std430, set = 0, binding = 11) readonly buffer SphereGeomBuffer
+{
+	vec4 sphere_geoms[];
+};
+
+//rgb holds the running sum of radiance, a the number of samples taken
+layout(std430, set = 0, binding = 2) buffer AccumBuffer
+{
+	vec4 accum[];
+};
+
+//rays traced per pass, one counter per frame slot, read back by the host profiler
+layout(std430, set = 0, binding = 3) buffer StatsBuffer
+{
+	uint ray_counts[];
+};
+
+shared uint group_rays;
+
+
+uint rng_state;
+
+uint
+pcg_hash(uint v)
+{
+	uint state = v * 747796405u + 2891336453u;
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+float
+rand()
+{
+	rng_state = pcg_hash(rng_state);
+	return float(rng_state >> 8) * (1.0 / 16777216.0);
+}
+
+vec3
+rand_unit_vector()
+{
+	float z = rand() * 2.0 - 1.0;
+	float a = rand() * 6.28318530718;
+	float r = sqrt(max(0.0, 1.0 - z * z));
+	return vec3(r * cos(a), r * sin(a), z);
+}
+
+//same seed and jitter for a pixel whichever integrator traces it
+vec3
+primary_ray_dir(uvec2 pixel)
+{
+	uint idx = pixel.y * params.width + pixel.x;
+	rng_state = pcg_hash(idx ^ pcg_hash(pc.sample_idx ^ pc.seed));
+
+	float s = (float(pixel.x) + rand()) / float(params.width);
+	float t = 1.0 - (float(pixel.y) + rand()) / float(params.height);
+
+	return normalize(pc.cam_lower_left.xyz + s * pc.cam_horizontal.xyz + t * pc.cam_vertical.xyz - pc.cam_origin.xyz);
+}
+
+
+bool
+hit_sphere(uint idx, vec3 ro, vec3 rd, float t_max, out float t)
+{
+	vec4 geom = sphere_geoms[idx];
+	vec3 oc = ro - geom.xyz;
+	float b = dot(oc, rd);
+	float c = dot(oc, oc) - geom.w * geom.w;
+	float disc = b * b - c;
+	if(disc < 0.0)
+		return false;
+
+	float sq = sqrt(disc);
+	t = -b - sq;
+	if(t < T_MIN)
+		t = -b + sq;
+
+	return t >= T_MIN && t < t_max;
+}
+
+//t_entry doesn't depend on t_max, so the order of two children is the same every time they're visited
+bool
+hit_node(uint idx, vec3 ro, vec3 inv_rd, float t_max, out float t_entry)
+{
+	vec3 t0 = (nodes[idx].bmin - ro) * inv_rd;
+	vec3 t1 = (nodes[idx].bmax - ro) * inv_rd;
+	vec3 t_near = min(t0, t1);
+	vec3 t_far = max(t0, t1);
+	t_entry = max(max(t_near.x, t_near.y), max(t_near.z, T_MIN));
+	float t_exit = min(min(t_far.x, t_far.y), t_far.z);
+	return t_entry <= t_exit && t_entry < t_max;
+}
+
+#define SHORT_STACK_SIZE 4u
+
+//bvh traversal with a short stack that lives in registers, and a restart trail for when it overflows
+//the trail has one bit per level, set once the level's last child to visit has been entered
+//popping adds the current level's bit to the trail, and the carry lands on the deepest level that still has a child left,
+//which is then taken from the stack, or reached again from the root by following the trail if the stack lost it
+bool
+closest_hit(vec3 ro, vec3 rd, out float t_hit, out uint hit_idx)
+{
+	t_hit = T_MAX;
+	hit_idx = 0u;
+	bool found = false;
+
+	vec3 inv_rd = 1.0 / rd;
+	float t_entry;
+	if(!hit_node(0u, ro, inv_rd, t_hit, t_entry))
+		return false;
+
+	uint stack_node[SHORT_STACK_SIZE];
+	uint stack_level[SHORT_STACK_SIZE];
+	uint stack_top = 0u; //only ever grows or shrinks by one, entries wrap around and overwrite the oldest
+	uint stack_size = 0u;
+
+	uint node = 0u;
+	uint level = 1u << 31; //trail bit for choosing between the current node's children
+	uint trail = 0u;
+
+	while(true)
+	{
+		BvhNode n = nodes[node];
+		if(n.count == 0u)
+		{
+			float t_left, t_right;
+			bool hit_left = hit_node(n.left_first, ro, inv_rd, t_hit, t_left);
+			bool hit_right = hit_node(n.left_first + 1u, ro, inv_rd, t_hit, t_right);
+
+			bool left_near = t_left <= t_right;
+			uint near_node = left_near ? n.left_first : n.left_first + 1u;
+			uint far_node = left_near ? n.left_first + 1u : n.left_first;
+
+			if(hit_left && hit_right)
+			{
+				if((trail & level) != 0u)
+					node = far_node;
+				else
+				{
+					stack_node[stack_top % SHORT_STACK_SIZE] = far_node;
+					stack_level[stack_top % SHORT_STACK_SIZE] = level;
+					stack_top++;
+					stack_size = min(stack_size + 1u, SHORT_STACK_SIZE);
+					node = near_node;
+				}
+				level >>= 1;
+				continue;
+			}
+			else if(hit_left || hit_right)
+			{
+				//the only child is also the last one at this level
+				trail |= level;
+				node = hit_left ? n.left_first : n.left_first + 1u;
+				level >>= 1;
+				continue;
+			}
+		}
+		else
+		{
+			for(uint i = n.left_first; i < n.left_first + n.count; i++)
+			{
+				float t;
+				if(hit_sphere(i, ro, rd, t_hit, t))
+				{
+					t_hit = t;
+					hit_idx = i;
+					found = true;
+				}
+			}
+		}
+
+		//pop, the bit of the level the current node was entered from is 0 for the root
+		uint depth_bit = level << 1;
+		if(depth_bit == 0u)
+			break;
+
+		trail &= ~(depth_bit - 1u);
+		trail += depth_bit;
+		if(trail == 0u)
+			break; //carried out of the top level, every level is done
+
+		depth_bit = trail & (~trail + 1u);
+		level = depth_bit >> 1;
+
+		while(stack_size > 0u && stack_level[(stack_top - 1u) % SHORT_STACK_SIZE] < depth_bit)
+		{
+			stack_top--;
+			stack_size--;
+		}
+
+		if(stack_size > 0u && stack_level[(stack_top - 1u) % SHORT_STACK_SIZE] == depth_bit)
+		{
+			stack_top--;
+			stack_size--;
+			node = stack_node[stack_top % SHORT_STACK_SIZE];
+		}
+		else
+		{
+			node = 0u;
+			level = 1u << 31;
+		}
+	}
+
+	return found;
+}
+
+vec3
+sky(vec3 rd)
+{
+	float t = 0.5 * (rd.y + 1.0);
+	return mix(vec3(1.0), vec3(0.5, 0.7, 1.0), t) * 0.3;
+}
+
+float
+schlick(float cosine, float ior)
+{
+	float r0 = (1.0 - ior) / (1.0 + ior);
+	r0 = r0 * r0;
+	return r0 + (1.0 - r0) * pow(1.0 - cosine, 5.0);
+}
+
+//picks the next direction off a surface, returns false if the path is absorbed
+//with a material toggle specialized to false its whole branch is compiled out
+bool
+scatter(Sphere s, bool front, vec3 ffn, inout vec3 rd)
+{
+	if(USE_METAL && s.material == MATERIAL_METAL)
+	{
+		rd = normalize(reflect(rd, ffn) + s.param * rand_unit_vector());
+		return dot(rd, ffn) > 0.0;
+	}
+	else if(USE_DIELECTRIC && s.material == MATERIAL_DIELECTRIC)
+	{
+		float eta = front ? 1.0 / s.param : s.param;
+		float cos_theta = min(dot(-rd, ffn), 1.0);
+		float sin_theta = sqrt(1.0 - cos_theta * cos_theta);
+		if(eta * sin_theta > 1.0 || schlick(cos_theta, eta) > rand())
+			rd = reflect(rd, ffn);
+		else
+			rd = refract(rd, ffn, eta);
+		return true;
+	}
+
+	rd = normalize(ffn + rand_unit_vector());
+	return true;
+}
+
+//call from every invocation, it contains barriers
+void
+add_group_rays(uint rays)
+{
+	if(gl_LocalInvocationIndex == 0u)
+		group_rays = 0u;
+	barrier();
+
+	atomicAdd(group_rays, rays);
+
+	//one global atomic per workgroup instead of one per invocation
+	barrier();
+	if(gl_LocalInvocationIndex == 0u)
+		atomicAdd(ray_counts[pc.stats_slot], group_rays);
+}
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "cpu_packet.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+//the packet kernels only exist on x86, see the makefile
+#if defined(__x86_64__) || defined(__i386__)
+#define HAS_PACKET_KERNELS 1
+#else
+#define HAS_PACKET_KERNELS 0
+#endif
+
+
+PacketIsa
+choose_packet_isa()
+{
+	PacketIsa isa = PACKET_ISA_SCALAR;
+#if HAS_PACKET_KERNELS
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		isa = PACKET_ISA_AVX512;
+	else if(__builtin_cpu_supports("avx2"))
+		isa = PACKET_ISA_AVX2;
+#endif
+
+	if(const char* env = getenv("RP_SIMD"))
+	{
+		PacketIsa wanted;
+		if(strcmp(env, "scalar") == 0)
+			wanted = PACKET_ISA_SCALAR;
+		else if(strcmp(env, "avx2") == 0)
+			wanted = PACKET_ISA_AVX2;
+		else if(strcmp(env, "avx512") == 0)
+			wanted = PACKET_ISA_AVX512;
+		else
+		{
+			fprintf(stderr, "WARNING: unknown RP_SIMD %s, expected scalar, avx2 or avx512\n", env);
+			return isa;
+		}
+
+		if(wanted > isa)
+			fprintf(stderr, "WARNING: %s isn't supported here, using %s\n", packet_isa_name(wanted), packet_isa_name(isa));
+		else
+			isa = wanted;
+	}
+	return isa;
+}
+
+uint32_t
+packet_isa_width(PacketIsa isa)
+{
+	switch(isa)
+	{
+		case PACKET_ISA_AVX2: return 8;
+		case PACKET_ISA_AVX512: return 16;
+		default: return 1;
+	}
+}
+
+const char*
+packet_isa_name(PacketIsa isa)
+{
+	switch(isa)
+	{
+		case PACKET_ISA_AVX2: return "avx2";
+		case PACKET_ISA_AVX512: return "avx512";
+		default: return "scalar";
+	}
+}
+
+PacketHitFunc
+packet_hit_func(PacketIsa isa)
+{
+#if HAS_PACKET_KERNELS
+	switch(isa)
+	{
+		case PACKET_ISA_AVX2: return closest_hit_packet_avx2;
+		case PACKET_ISA_AVX512: return closest_hit_packet_avx512;
+		default: return nullptr;
+	}
+#else
+	(void)isa;
+	return nullptr;
+#endif
+}
+
+LeafHitFunc
+leaf_hit_func(PacketIsa isa)
+{
+#if HAS_PACKET_KERNELS
+	switch(isa)
+	{
+		case PACKET_ISA_AVX2: return leaf_hit_avx2;
+		case PACKET_ISA_AVX512: return leaf_hit_avx512;
+		default: return nullptr;
+	}
+#else
+	(void)isa;
+	return nullptr;
+#endif
+}
\ No newline at end of file
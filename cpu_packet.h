@@ -0,0 +1,57 @@
+#pragma once
+#include "bvh.h"
+#include "scene.h"
+
+#include <cstdint>
+
+//T_MIN and T_MAX in common.glsl
+constexpr float t_min = 0.001f;
+constexpr float t_max = 1e30f;
+
+//the widest packet any of the kernels traces
+constexpr uint32_t max_packet_width = 16;
+
+//rays of neighbouring pixels that all leave the same origin, like the primary rays of a pinhole camera
+//directions are stored per axis so a kernel loads one axis of every lane at once
+//lanes past count are ignored, but still have to hold a direction
+struct RayPacket
+{
+	float origin[3];
+	float dir[3][max_packet_width];
+	uint32_t count;
+};
+
+//the centers and radii of the spheres, in bvh order, an array per field so a leaf's spheres load as one vector each
+//every array runs max_packet_width past the last sphere, so a kernel may load a whole vector from any leaf
+struct SphereSoa
+{
+	const float* center[3];
+	const float* radius;
+};
+
+enum PacketIsa
+{
+	PACKET_ISA_SCALAR, //no packet kernel, every ray is traced on its own
+	PACKET_ISA_AVX2,
+	PACKET_ISA_AVX512,
+};
+
+//closest hit of every lane, t_hit is t_max and hit_idx 0 for lanes that hit nothing
+typedef void (*PacketHitFunc)(const BvhNode* node_array, const SphereSoa& soa, const RayPacket& packet, float* t_hit, uint32_t* hit_idx);
+
+//one ray against the spheres [first, first + count) of a leaf, a vector of them at a time
+//only updates t_hit and hit_idx for a hit closer than t_hit, ties go to the lower index like a loop over them would
+typedef bool (*LeafHitFunc)(const SphereSoa& soa, uint32_t first, uint32_t count, const float* ro, const float* rd, float* t_hit, uint32_t* hit_idx);
+
+//the widest isa both the build and the host support, RP_SIMD=scalar, avx2 or avx512 asks for a narrower one
+PacketIsa choose_packet_isa();
+uint32_t packet_isa_width(PacketIsa isa);
+const char* packet_isa_name(PacketIsa isa);
+PacketHitFunc packet_hit_func(PacketIsa isa);
+LeafHitFunc leaf_hit_func(PacketIsa isa);
+
+//defined in their own translation units, which are the only ones built for those isas
+void closest_hit_packet_avx2(const BvhNode* node_array, const SphereSoa& soa, const RayPacket& packet, float* t_hit, uint32_t* hit_idx);
+void closest_hit_packet_avx512(const BvhNode* node_array, const SphereSoa& soa, const RayPacket& packet, float* t_hit, uint32_t* hit_idx);
+bool leaf_hit_avx2(const SphereSoa& soa, uint32_t first, uint32_t count, const float* ro, const float* rd, float* t_hit, uint32_t* hit_idx);
+bool leaf_hit_avx512(const SphereSoa& soa, uint32_t first, uint32_t count, const float* ro, const float* rd, float* t_hit, uint32_t* hit_idx);
\ No newline at end of file
@@ -0,0 +1,64 @@
+#include "cpu_packet_kernel.h"
+
+//built with -mavx2 on x86, only called once choose_packet_isa has seen the host support it
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+namespace
+{
+
+//masks are full width floats with every bit of a lane set or clear, the way the compare instructions leave them
+struct Avx2
+{
+	typedef __m256 F;
+	typedef __m256 M;
+	typedef __m256i I;
+
+	static constexpr uint32_t width = 8;
+
+	static inline F load(const float* p) { return _mm256_loadu_ps(p); }
+	static inline void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+	static inline F set1(float v) { return _mm256_set1_ps(v); }
+	static inline F add(F a, F b) { return _mm256_add_ps(a, b); }
+	static inline F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+	static inline F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+	static inline F div(F a, F b) { return _mm256_div_ps(a, b); }
+	static inline F min(F a, F b) { return _mm256_min_ps(a, b); }
+	static inline F max(F a, F b) { return _mm256_max_ps(a, b); }
+	static inline F sqrt(F a) { return _mm256_sqrt_ps(a); }
+
+	static inline M lt(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static inline M le(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static inline M ge(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static inline M and_(M a, M b) { return _mm256_and_ps(a, b); }
+	static inline uint32_t bits(M m) { return (uint32_t)_mm256_movemask_ps(m); }
+	static inline bool any(M m) { return _mm256_movemask_ps(m) != 0; }
+	static inline F select(M m, F a, F b) { return _mm256_blendv_ps(b, a, m); }
+
+	static inline M
+	lane_mask(uint32_t count)
+	{
+		const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		return _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32((int)count), lane));
+	}
+
+	static inline I set1_i(uint32_t v) { return _mm256_set1_epi32((int)v); }
+	static inline void store_i(uint32_t* p, I a) { _mm256_storeu_si256((__m256i*)p, a); }
+	static inline I select_i(M m, I a, I b) { return _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(b), _mm256_castsi256_ps(a), m)); }
+};
+
+}
+
+void
+closest_hit_packet_avx2(const BvhNode* node_array, const SphereSoa& soa, const RayPacket& packet, float* t_hit, uint32_t* hit_idx)
+{
+	packet_closest_hit<Avx2>(node_array, soa, packet, t_hit, hit_idx);
+}
+
+bool
+leaf_hit_avx2(const SphereSoa& soa, uint32_t first, uint32_t count, const float* ro, const float* rd, float* t_hit, uint32_t* hit_idx)
+{
+	return leaf_hit<Avx2>(soa, first, count, ro, rd, t_hit, hit_idx);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include "cpu_packet_kernel.h"
+
+//built with -mavx512f on x86, only called once choose_packet_isa has seen the host support it
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+namespace
+{
+
+//masks are the k registers, one bit per lane
+struct Avx512
+{
+	typedef __m512 F;
+	typedef __mmask16 M;
+	typedef __m512i I;
+
+	static constexpr uint32_t width = 16;
+
+	static inline F load(const float* p) { return _mm512_loadu_ps(p); }
+	static inline void store(float* p, F a) { _mm512_storeu_ps(p, a); }
+	static inline F set1(float v) { return _mm512_set1_ps(v); }
+	static inline F add(F a, F b) { return _mm512_add_ps(a, b); }
+	static inline F sub(F a, F b) { return _mm512_sub_ps(a, b); }
+	static inline F mul(F a, F b) { return _mm512_mul_ps(a, b); }
+	static inline F div(F a, F b) { return _mm512_div_ps(a, b); }
+	static inline F min(F a, F b) { return _mm512_min_ps(a, b); }
+	static inline F max(F a, F b) { return _mm512_max_ps(a, b); }
+	static inline F sqrt(F a) { return _mm512_sqrt_ps(a); }
+
+	static inline M lt(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	static inline M le(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+	static inline M ge(F a, F b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+	static inline M and_(M a, M b) { return (M)(a & b); }
+	static inline uint32_t bits(M m) { return m; }
+	static inline bool any(M m) { return m != 0; }
+	static inline F select(M m, F a, F b) { return _mm512_mask_blend_ps(m, b, a); }
+	static inline M lane_mask(uint32_t count) { return count >= 16 ? (M)0xffff : (M)((1u << count) - 1); }
+
+	static inline I set1_i(uint32_t v) { return _mm512_set1_epi32((int)v); }
+	static inline void store_i(uint32_t* p, I a) { _mm512_storeu_si512(p, a); }
+	static inline I select_i(M m, I a, I b) { return _mm512_mask_blend_epi32(m, b, a); }
+};
+
+}
+
+void
+closest_hit_packet_avx512(const BvhNode* node_array, const SphereSoa& soa, const RayPacket& packet, float* t_hit, uint32_t* hit_idx)
+{
+	packet_closest_hit<Avx512>(node_array, soa, packet, t_hit, hit_idx);
+}
+
+bool
+leaf_hit_avx512(const SphereSoa& soa, uint32_t first, uint32_t count, const float* ro, const float* rd, float* t_hit, uint32_t* hit_idx)
+{
+	return leaf_hit<Avx512>(soa, first, count, ro, rd, t_hit, hit_idx);
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,190 @@
+#pragma once
+#include "cpu_packet.h"
+
+//the packet traversal, written once against a vector type V and included by each isa's translation unit
+//those are built with flags the rest of the program can't assume, so nothing here may have external linkage,
+//or the linker could pick a copy built for an isa the host doesn't have; that includes the standard library
+//V provides width, F (float lanes), M (lane mask), I (uint32 lanes) and the operations on them, see cpu_packet_avx2.cpp
+namespace
+{
+
+//common.glsl's hit_node for every lane, the lanes not in active never hit
+template<typename V>
+inline typename V::M
+packet_hit_node(const BvhNode& node, const float* origin, const typename V::F* inv_dir, typename V::F t_hit, typename V::M active, typename V::F* t_entry)
+{
+	typedef typename V::F F;
+
+	F t_near[3];
+	F t_far[3];
+	for(int a = 0; a < 3; a++)
+	{
+		const F t0 = V::mul(V::set1(node.bmin[a] - origin[a]), inv_dir[a]);
+		const F t1 = V::mul(V::set1(node.bmax[a] - origin[a]), inv_dir[a]);
+		t_near[a] = V::min(t0, t1);
+		t_far[a] = V::max(t0, t1);
+	}
+
+	*t_entry = V::max(V::max(t_near[0], t_near[1]), V::max(t_near[2], V::set1(t_min)));
+	const F t_exit = V::min(V::min(t_far[0], t_far[1]), t_far[2]);
+	return V::and_(active, V::and_(V::le(*t_entry, t_exit), V::lt(*t_entry, t_hit)));
+}
+
+//every lane leaves the same origin, so only b differs between them and the rest is worked out once per sphere
+template<typename V>
+inline void
+packet_hit_sphere(const SphereSoa& soa, uint32_t idx, const float* origin, const typename V::F* dir, typename V::M active,
+	typename V::F* t_hit, typename V::I* hit_idx)
+{
+	typedef typename V::F F;
+	typedef typename V::M M;
+
+	const float oc[3] = { origin[0] - soa.center[0][idx], origin[1] - soa.center[1][idx], origin[2] - soa.center[2][idx] };
+	const float c = oc[0] * oc[0] + oc[1] * oc[1] + oc[2] * oc[2] - soa.radius[idx] * soa.radius[idx];
+
+	const F b = V::add(V::add(V::mul(V::set1(oc[0]), dir[0]), V::mul(V::set1(oc[1]), dir[1])), V::mul(V::set1(oc[2]), dir[2]));
+	const F disc = V::sub(V::mul(b, b), V::set1(c));
+	M hit = V::and_(active, V::ge(disc, V::set1(0.0f)));
+	if(!V::any(hit))
+		return;
+
+	//lanes that missed take the square root of a negative number, they are masked out below
+	const F sq = V::sqrt(V::max(disc, V::set1(0.0f)));
+	const F neg_b = V::sub(V::set1(0.0f), b);
+	F t = V::sub(neg_b, sq);
+	t = V::select(V::lt(t, V::set1(t_min)), V::add(neg_b, sq), t);
+
+	hit = V::and_(hit, V::and_(V::ge(t, V::set1(t_min)), V::lt(t, *t_hit)));
+	*t_hit = V::select(hit, t, *t_hit);
+	*hit_idx = V::select_i(hit, V::set1_i(idx), *hit_idx);
+}
+
+//the packet goes down a node if any of its lanes would, nodes only some lanes hit cost the others nothing but idle lanes
+//primary rays of neighbouring pixels mostly agree, which is what makes that cheaper than tracing them one by one
+template<typename V>
+inline void
+packet_closest_hit(const BvhNode* node_array, const SphereSoa& soa, const RayPacket& packet, float* t_hit_out, uint32_t* hit_idx_out)
+{
+	typedef typename V::F F;
+	typedef typename V::M M;
+
+	F dir[3];
+	F inv_dir[3];
+	for(int a = 0; a < 3; a++)
+	{
+		dir[a] = V::load(packet.dir[a]);
+		inv_dir[a] = V::div(V::set1(1.0f), dir[a]);
+	}
+
+	const M active = V::lane_mask(packet.count);
+	F t_hit = V::set1(t_max);
+	typename V::I hit_idx = V::set1_i(0);
+
+	F t_entry;
+	if(V::any(packet_hit_node<V>(node_array[0], packet.origin, inv_dir, t_hit, active, &t_entry)))
+	{
+		uint32_t stack[bvh_max_depth + 1];
+		uint32_t stack_size = 0;
+		uint32_t node = 0;
+
+		for(;;)
+		{
+			const BvhNode& n = node_array[node];
+			if(n.count == 0)
+			{
+				F t_left, t_right;
+				const M hit_left = packet_hit_node<V>(node_array[n.left_first], packet.origin, inv_dir, t_hit, active, &t_left);
+				const M hit_right = packet_hit_node<V>(node_array[n.left_first + 1], packet.origin, inv_dir, t_hit, active, &t_right);
+				const bool any_left = V::any(hit_left);
+				const bool any_right = V::any(hit_right);
+
+				if(any_left && any_right)
+				{
+					//near first for the majority of the lanes that hit both
+					const M both = V::and_(hit_left, hit_right);
+					const int left_near_count = __builtin_popcount(V::bits(V::and_(both, V::le(t_left, t_right))));
+					const bool left_near = 2 * left_near_count >= __builtin_popcount(V::bits(both));
+					stack[stack_size++] = left_near ? n.left_first + 1 : n.left_first;
+					node = left_near ? n.left_first : n.left_first + 1;
+					continue;
+				}
+				else if(any_left || any_right)
+				{
+					node = any_left ? n.left_first : n.left_first + 1;
+					continue;
+				}
+			}
+			else
+			{
+				for(uint32_t i = n.left_first; i < n.left_first + n.count; i++)
+					packet_hit_sphere<V>(soa, i, packet.origin, dir, active, &t_hit, &hit_idx);
+			}
+
+			//a hit found since a node was pushed may rule it out for every lane, so it is tested again
+			bool popped = false;
+			while(stack_size > 0 && !popped)
+			{
+				node = stack[--stack_size];
+				popped = V::any(packet_hit_node<V>(node_array[node], packet.origin, inv_dir, t_hit, active, &t_entry));
+			}
+			if(!popped)
+				break;
+		}
+	}
+
+	V::store(t_hit_out, t_hit);
+	V::store_i(hit_idx_out, hit_idx);
+}
+
+//the other way around from the packet, one ray against a vector of spheres, for the bounces whose rays don't make packets
+//leaves are built width spheres big, so a leaf is usually one pass; the soa padding makes the loads past its end safe
+//lanes beating t_hit are then taken in index order, which gives the same hit as the scalar loop even for ties
+template<typename V>
+inline bool
+leaf_hit(const SphereSoa& soa, uint32_t first, uint32_t count, const float* ro, const float* rd, float* t_hit, uint32_t* hit_idx)
+{
+	typedef typename V::F F;
+	typedef typename V::M M;
+
+	bool found = false;
+	for(uint32_t base = first; base < first + count; base += V::width)
+	{
+		F oc[3];
+		for(int a = 0; a < 3; a++)
+			oc[a] = V::sub(V::set1(ro[a]), V::load(soa.center[a] + base));
+		const F radius = V::load(soa.radius + base);
+
+		const F b = V::add(V::add(V::mul(oc[0], V::set1(rd[0])), V::mul(oc[1], V::set1(rd[1]))), V::mul(oc[2], V::set1(rd[2])));
+		const F c = V::sub(V::add(V::add(V::mul(oc[0], oc[0]), V::mul(oc[1], oc[1])), V::mul(oc[2], oc[2])), V::mul(radius, radius));
+		const F disc = V::sub(V::mul(b, b), c);
+		M hit = V::and_(V::lane_mask(first + count - base), V::ge(disc, V::set1(0.0f)));
+		if(!V::any(hit))
+			continue;
+
+		const F sq = V::sqrt(V::max(disc, V::set1(0.0f)));
+		const F neg_b = V::sub(V::set1(0.0f), b);
+		F t = V::sub(neg_b, sq);
+		t = V::select(V::lt(t, V::set1(t_min)), V::add(neg_b, sq), t);
+		hit = V::and_(hit, V::and_(V::ge(t, V::set1(t_min)), V::lt(t, V::set1(*t_hit))));
+
+		uint32_t bits = V::bits(hit);
+		if(bits == 0)
+			continue;
+
+		float t_lane[V::width];
+		V::store(t_lane, t);
+		for(; bits != 0; bits &= bits - 1)
+		{
+			const uint32_t lane = __builtin_ctz(bits);
+			if(t_lane[lane] < *t_hit)
+			{
+				*t_hit = t_lane[lane];
+				*hit_idx = base + lane;
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+}
\ No newline at end of file
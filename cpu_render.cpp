@@ -0,0 +1,877 @@
+#include "cpu_render.h"
+#include "cpu_packet.h"
+#include "image.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+
+static const size_t cache_line_size = 64;
+
+//the unit of work a thread takes at a time, big enough that taking one is cheap next to tracing it
+//and small enough that a 720p frame still has dozens per thread on a 128 core machine to balance with
+static const uint32_t cpu_tile_size = 16;
+
+
+//the same math as the glsl built ins, so the paths match the kernel's
+struct Vec3
+{
+	float x, y, z;
+};
+
+static inline Vec3 vec3(float x, float y, float z) { return { x, y, z }; }
+static inline Vec3 vec3(const float* v) { return { v[0], v[1], v[2] }; }
+static inline Vec3 operator+(Vec3 a, Vec3 b) { return { a.x + b.x, a.y + b.y, a.z + b.z }; }
+static inline Vec3 operator-(Vec3 a, Vec3 b) { return { a.x - b.x, a.y - b.y, a.z - b.z }; }
+static inline Vec3 operator-(Vec3 a) { return { -a.x, -a.y, -a.z }; }
+static inline Vec3 operator*(Vec3 a, Vec3 b) { return { a.x * b.x, a.y * b.y, a.z * b.z }; }
+static inline Vec3 operator*(Vec3 a, float s) { return { a.x * s, a.y * s, a.z * s }; }
+static inline Vec3 operator*(float s, Vec3 a) { return a * s; }
+static inline Vec3 operator/(Vec3 a, float s) { return { a.x / s, a.y / s, a.z / s }; }
+static inline float dot(Vec3 a, Vec3 b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+static inline Vec3 normalize(Vec3 a) { return a * (1.0f / sqrtf(dot(a, a))); }
+static inline Vec3 reflect(Vec3 i, Vec3 n) { return i - 2.0f * dot(n, i) * n; }
+static inline float min(float a, float b) { return b < a ? b : a; }
+static inline float max(float a, float b) { return a < b ? b : a; }
+
+static inline Vec3
+refract(Vec3 i, Vec3 n, float eta)
+{
+	const float k = 1.0f - eta * eta * (1.0f - dot(n, i) * dot(n, i));
+	if(k < 0.0f)
+		return vec3(0.0f, 0.0f, 0.0f);
+	return eta * i - (eta * dot(n, i) + sqrtf(k)) * n;
+}
+
+
+static inline uint32_t
+pcg_hash(uint32_t v)
+{
+	const uint32_t state = v * 747796405u + 2891336453u;
+	const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+static inline float
+rand_float(uint32_t* rng_state)
+{
+	*rng_state = pcg_hash(*rng_state);
+	return float(*rng_state >> 8) * (1.0f / 16777216.0f);
+}
+
+static inline Vec3
+rand_unit_vector(uint32_t* rng_state)
+{
+	const float z = rand_float(rng_state) * 2.0f - 1.0f;
+	const float a = rand_float(rng_state) * 6.28318530718f;
+	const float r = sqrtf(max(0.0f, 1.0f - z * z));
+	return vec3(r * cosf(a), r * sinf(a), z);
+}
+
+static inline float
+schlick(float cosine, float ior)
+{
+	float r0 = (1.0f - ior) / (1.0f + ior);
+	r0 = r0 * r0;
+	return r0 + (1.0f - r0) * powf(1.0f - cosine, 5.0f);
+}
+
+
+static inline bool
+hit_sphere(const Sphere& s, Vec3 ro, Vec3 rd, float t_limit, float* t)
+{
+	const Vec3 oc = ro - vec3(s.center);
+	const float b = dot(oc, rd);
+	const float c = dot(oc, oc) - s.radius * s.radius;
+	const float disc = b * b - c;
+	if(disc < 0.0f)
+		return false;
+
+	const float sq = sqrtf(disc);
+	*t = -b - sq;
+	if(*t < t_min)
+		*t = -b + sq;
+
+	return *t >= t_min && *t < t_limit;
+}
+
+static inline bool
+hit_node(const BvhNode& node, Vec3 ro, Vec3 inv_rd, float t_limit, float* t_entry)
+{
+	const Vec3 t0 = (vec3(node.bmin) - ro) * inv_rd;
+	const Vec3 t1 = (vec3(node.bmax) - ro) * inv_rd;
+	const float t_near = max(max(min(t0.x, t1.x), min(t0.y, t1.y)), max(min(t0.z, t1.z), t_min));
+	const float t_far = min(min(max(t0.x, t1.x), max(t0.y, t1.y)), max(t0.z, t1.z));
+	*t_entry = t_near;
+	return t_near <= t_far && t_near < t_limit;
+}
+
+//what closest_hit reads of the scene
+struct HitScene
+{
+	const BvhNode* node_array;
+	const Sphere* sphere_array;
+	SphereSoa sphere_soa;
+	LeafHitFunc leaf_hit; //null for scalar, leaves are then tested a sphere at a time
+};
+
+//an ordinary stack is cheap on the host, the kernel's short stack and restart trail only save registers
+static bool
+closest_hit(const HitScene& hs, Vec3 ro, Vec3 rd, float* t_hit, uint32_t* hit_idx)
+{
+	*t_hit = t_max;
+	*hit_idx = 0;
+	bool found = false;
+
+	const Vec3 inv_rd = vec3(1.0f / rd.x, 1.0f / rd.y, 1.0f / rd.z);
+	float t_entry;
+	if(!hit_node(hs.node_array[0], ro, inv_rd, *t_hit, &t_entry))
+		return false;
+
+	uint32_t stack[bvh_max_depth + 1];
+	uint32_t stack_size = 0;
+	uint32_t node = 0;
+
+	for(;;)
+	{
+		const BvhNode& n = hs.node_array[node];
+		if(n.count == 0)
+		{
+			float t_left, t_right;
+			const bool hit_left = hit_node(hs.node_array[n.left_first], ro, inv_rd, *t_hit, &t_left);
+			const bool hit_right = hit_node(hs.node_array[n.left_first + 1], ro, inv_rd, *t_hit, &t_right);
+
+			if(hit_left && hit_right)
+			{
+				const bool left_near = t_left <= t_right;
+				stack[stack_size++] = left_near ? n.left_first + 1 : n.left_first;
+				node = left_near ? n.left_first : n.left_first + 1;
+				continue;
+			}
+			else if(hit_left || hit_right)
+			{
+				node = hit_left ? n.left_first : n.left_first + 1;
+				continue;
+			}
+		}
+		else if(hs.leaf_hit != nullptr)
+		{
+			const float ro_array[3] = { ro.x, ro.y, ro.z };
+			const float rd_array[3] = { rd.x, rd.y, rd.z };
+			if(hs.leaf_hit(hs.sphere_soa, n.left_first, n.count, ro_array, rd_array, t_hit, hit_idx))
+				found = true;
+		}
+		else
+		{
+			for(uint32_t i = n.left_first; i < n.left_first + n.count; i++)
+			{
+				float t;
+				if(hit_sphere(hs.sphere_array[i], ro, rd, *t_hit, &t))
+				{
+					*t_hit = t;
+					*hit_idx = i;
+					found = true;
+				}
+			}
+		}
+
+		if(stack_size == 0)
+			break;
+		node = stack[--stack_size];
+	}
+
+	return found;
+}
+
+static inline Vec3
+sky(Vec3 rd)
+{
+	const float t = 0.5f * (rd.y + 1.0f);
+	return (vec3(1.0f, 1.0f, 1.0f) * (1.0f - t) + vec3(0.5f, 0.7f, 1.0f) * t) * 0.3f;
+}
+
+static inline bool
+scatter(const Sphere& s, bool front, Vec3 ffn, Vec3* rd, uint32_t* rng_state)
+{
+	if(s.material == MATERIAL_METAL)
+	{
+		*rd = normalize(reflect(*rd, ffn) + s.param * rand_unit_vector(rng_state));
+		return dot(*rd, ffn) > 0.0f;
+	}
+	else if(s.material == MATERIAL_DIELECTRIC)
+	{
+		const float eta = front ? 1.0f / s.param : s.param;
+		const float cos_theta = min(dot(-*rd, ffn), 1.0f);
+		const float sin_theta = sqrtf(1.0f - cos_theta * cos_theta);
+		if(eta * sin_theta > 1.0f || schlick(cos_theta, eta) > rand_float(rng_state))
+			*rd = reflect(*rd, ffn);
+		else
+			*rd = refract(*rd, ffn, eta);
+		return true;
+	}
+
+	*rd = normalize(ffn + rand_unit_vector(rng_state));
+	return true;
+}
+
+//the first hit of a path when it was found by a packet kernel, t is t_max if it hit nothing
+struct PrimaryHit
+{
+	float t;
+	uint32_t idx;
+};
+
+//path.comp's trace()
+static Vec3
+trace(const Scene& scene, const HitScene& hs, Vec3 ro, Vec3 rd, uint32_t* rng_state, uint32_t* rays, const PrimaryHit* primary)
+{
+	Vec3 radiance = vec3(0.0f, 0.0f, 0.0f);
+	Vec3 throughput = vec3(1.0f, 1.0f, 1.0f);
+
+	for(uint32_t bounce = 0; bounce <= scene.max_bounces; bounce++)
+	{
+		float t;
+		uint32_t idx;
+		(*rays)++;
+		bool found;
+		if(bounce == 0 && primary != nullptr)
+		{
+			t = primary->t;
+			idx = primary->idx;
+			found = t < t_max;
+		}
+		else
+			found = closest_hit(hs, ro, rd, &t, &idx);
+
+		if(!found)
+		{
+			radiance = radiance + throughput * sky(rd);
+			break;
+		}
+
+		const Sphere& s = scene.sphere_vec[idx];
+		const Vec3 p = ro + rd * t;
+		const Vec3 n = (p - vec3(s.center)) / s.radius;
+		const bool front = dot(rd, n) < 0.0f;
+		const Vec3 ffn = front ? n : -n;
+
+		radiance = radiance + throughput * vec3(s.emission);
+
+		if(!scatter(s, front, ffn, &rd, rng_state))
+			break;
+
+		throughput = throughput * vec3(s.albedo);
+		ro = p;
+
+		if(max(throughput.x, max(throughput.y, throughput.z)) <= 0.0f)
+			break;
+	}
+
+	return radiance;
+}
+
+//common.glsl's primary_ray_dir, the same seed gives the same jitter as on the gpu
+//sample_seed is pcg_hash(sample_idx ^ seed), which every pixel of a sample shares
+static inline Vec3
+primary_ray_dir(const CameraFrame& frame, int width, int height, uint32_t x, uint32_t y, uint32_t sample_seed, uint32_t* rng_state)
+{
+	*rng_state = pcg_hash((y * width + x) ^ sample_seed);
+
+	const float s = (float(x) + rand_float(rng_state)) / float(width);
+	const float t = 1.0f - (float(y) + rand_float(rng_state)) / float(height);
+	return normalize(vec3(frame.lower_left) + s * vec3(frame.horizontal) + t * vec3(frame.vertical) - vec3(frame.origin));
+}
+
+
+static inline Vec3 load3(float* const* array, uint32_t i) { return { array[0][i], array[1][i], array[2][i] }; }
+static inline void store3(float* const* array, uint32_t i, Vec3 v) { array[0][i] = v.x; array[1][i] = v.y; array[2][i] = v.z; }
+
+//every array is a whole number of cache lines, so carving them out of one aligned block keeps each on a line of its own
+static_assert(max_packet_width * sizeof(float) % cache_line_size == 0, "ray stream arrays have to stay cache line aligned");
+
+static void
+create_ray_stream(RayStream* stream, uint32_t capacity)
+{
+	capacity = (capacity + max_packet_width - 1) / max_packet_width * max_packet_width;
+	const size_t array_size = (size_t)capacity * sizeof(float);
+	const size_t array_count = 16;
+
+	stream->storage = aligned_alloc(cache_line_size, array_size * array_count);
+	if(stream->storage == nullptr)
+	{
+		fprintf(stderr, "failed to allocate ray stream!\n");
+		exit(1);
+	}
+
+	char* next = (char*)stream->storage;
+	for(uint32_t a = 0; a < 3; a++, next += array_size)
+		stream->origin[a] = (float*)next;
+	for(uint32_t a = 0; a < 3; a++, next += array_size)
+		stream->dir[a] = (float*)next;
+	for(uint32_t a = 0; a < 3; a++, next += array_size)
+		stream->throughput[a] = (float*)next;
+	for(uint32_t a = 0; a < 3; a++, next += array_size)
+		stream->radiance[a] = (float*)next;
+	stream->t = (float*)next;
+	stream->hit_idx = (uint32_t*)(next + array_size);
+	stream->rng_state = (uint32_t*)(next + 2 * array_size);
+	stream->pixel = (uint32_t*)(next + 3 * array_size);
+	stream->capacity = capacity;
+}
+
+static void
+destroy_ray_stream(RayStream* stream)
+{
+	free(stream->storage);
+	stream->storage = nullptr;
+}
+
+
+CpuRenderer::CpuRenderer(const char* render_name, int width, int height, bool wavefront) : m_render_name(render_name), m_width(width), m_height(height),
+	m_wavefront(wavefront),
+	m_scene(), m_bvh_node_vec(), m_camera_frame(), m_sphere_soa_vec(), m_sphere_soa(), m_accum_vec(), m_region{ 0, (uint32_t)height }, m_thread_vec(), m_mutex(), m_work_cv(), m_done_cv(),
+	m_tile_order_vec(), m_worker_vec(), m_thread_stats_vec(), m_ray_count(0) {}
+CpuRenderer::~CpuRenderer(){}
+
+
+//RP_THREADS caps the pool, by default there is one thread per hardware thread
+void
+CpuRenderer::init()
+{
+	m_packet_isa = choose_packet_isa();
+	m_packet_hit = packet_hit_func(m_packet_isa);
+	m_leaf_hit = leaf_hit_func(m_packet_isa);
+	m_packet_width = packet_isa_width(m_packet_isa);
+
+	//a leaf as big as a vector is tested in one go by the leaf kernel, so the tree can be that much shallower
+	const uint32_t leaf_size = m_leaf_hit != nullptr ? m_packet_width : default_bvh_leaf_size;
+	if(!load_scene(m_render_name, &m_scene) || !build_bvh(&m_scene.sphere_vec, &m_bvh_node_vec, leaf_size))
+		exit(1);
+	make_camera_frame(m_scene.camera, m_width, m_height, &m_camera_frame);
+	build_sphere_soa();
+
+	m_accum_vec.assign((size_t)m_width * m_height * 4, 0.0f);
+	m_tile_count_x = (m_width + cpu_tile_size - 1) / cpu_tile_size;
+
+	uint32_t thread_count = std::thread::hardware_concurrency();
+	if(const char* env = getenv("RP_THREADS"))
+		thread_count = (uint32_t)atoi(env);
+	if(thread_count == 0)
+		thread_count = 1;
+
+	m_worker_vec = std::vector<CpuWorker>(thread_count);
+	m_thread_stats_vec.assign(thread_count, CpuThreadStats());
+	for(uint32_t i = 0; i < thread_count; i++)
+		m_thread_vec.emplace_back(&CpuRenderer::worker, this, i);
+
+	const char* log_path = getenv("RP_PROFILE_LOG");
+	if(log_path != nullptr)
+	{
+		m_profile_log = strcmp(log_path, "-") == 0 ? stderr : fopen(log_path, "a");
+		if(m_profile_log == nullptr)
+			fprintf(stderr, "WARNING: failed to open profile log %s\n", log_path);
+		else
+			fprintf(m_profile_log, "{\"event\":\"start\",\"render\":\"%s\",\"device\":\"cpu\",\"width\":%d,\"height\":%d,\"threads\":%u,\"simd\":\"%s\",\"integrator\":\"%s\"}\n",
+				m_render_name, m_width, m_height, thread_count, packet_isa_name(m_packet_isa), m_wavefront ? "wavefront" : "megakernel");
+	}
+}
+
+//copies the centers and radii out of m_scene.sphere_vec, which has to be in bvh order already
+void
+CpuRenderer::build_sphere_soa()
+{
+	const size_t sphere_count = m_scene.sphere_vec.size();
+	const size_t stride = sphere_count + max_packet_width;
+	m_sphere_soa_vec.assign(stride * 4, 0.0f);
+
+	float* array[4];
+	for(uint32_t a = 0; a < 4; a++)
+		array[a] = &m_sphere_soa_vec[stride * a];
+	for(size_t i = 0; i < sphere_count; i++)
+	{
+		const Sphere& s = m_scene.sphere_vec[i];
+		array[0][i] = s.center[0];
+		array[1][i] = s.center[1];
+		array[2][i] = s.center[2];
+		array[3][i] = s.radius;
+	}
+
+	for(uint32_t a = 0; a < 3; a++)
+		m_sphere_soa.center[a] = array[a];
+	m_sphere_soa.radius = array[3];
+}
+
+void
+CpuRenderer::quit()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_quit = true;
+	}
+	m_work_cv.notify_all();
+
+	for(std::thread& thread : m_thread_vec)
+		thread.join();
+	m_thread_vec.clear();
+
+	//whether the frames were spread evenly shows as idle time being low and about the same on every thread
+	for(size_t i = 0; i < m_thread_stats_vec.size() && m_profile_log != nullptr; i++)
+	{
+		const CpuThreadStats& stats = m_thread_stats_vec[i];
+		fprintf(m_profile_log, "{\"event\":\"thread\",\"thread\":%zu,\"tiles\":%llu,\"steals\":%llu,\"failed_steals\":%llu,\"busy_ms\":%.3f,\"idle_ms\":%.3f}\n",
+			i, (unsigned long long)stats.tile_count, (unsigned long long)stats.steal_count, (unsigned long long)stats.failed_steal_count, stats.busy_ms, stats.idle_ms);
+	}
+
+	if(m_profile_log != nullptr && m_profile_log != stderr)
+		fclose(m_profile_log);
+	m_profile_log = nullptr;
+}
+
+
+//spreads the bits of v over the even bits of the result
+static inline uint32_t
+part_bits(uint32_t v)
+{
+	v &= 0xffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+static inline uint64_t
+pack_range(uint32_t begin, uint32_t end)
+{
+	return (uint64_t)begin | (uint64_t)end << 32;
+}
+
+void
+CpuRenderer::order_tiles()
+{
+	const uint32_t row_tile_begin = m_region[0] / cpu_tile_size;
+	const uint32_t row_tile_end = (m_region[1] + cpu_tile_size - 1) / cpu_tile_size;
+
+	m_tile_order_vec.clear();
+	for(uint32_t y = row_tile_begin; y < row_tile_end; y++)
+	{
+		for(uint32_t x = 0; x < m_tile_count_x; x++)
+			m_tile_order_vec.push_back(y * m_tile_count_x + x);
+	}
+
+	std::sort(m_tile_order_vec.begin(), m_tile_order_vec.end(), [this](uint32_t a, uint32_t b)
+	{
+		const uint32_t code_a = part_bits(a % m_tile_count_x) | part_bits(a / m_tile_count_x) << 1;
+		const uint32_t code_b = part_bits(b % m_tile_count_x) | part_bits(b / m_tile_count_x) << 1;
+		return code_a < code_b;
+	});
+
+	m_order_region[0] = m_region[0];
+	m_order_region[1] = m_region[1];
+}
+
+
+//one sample for every pixel of the region, blocks until every thread is done with it
+//every thread starts on an equal slice of the z order, those that run out steal from the rest
+void
+CpuRenderer::render_frame()
+{
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	if(m_order_region[0] != m_region[0] || m_order_region[1] != m_region[1])
+		order_tiles();
+
+	const uint32_t thread_count = (uint32_t)m_thread_vec.size();
+	const uint32_t tile_count = (uint32_t)m_tile_order_vec.size();
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for(uint32_t i = 0; i < thread_count; i++)
+	{
+		CpuWorker& worker = m_worker_vec[i];
+		const uint32_t begin = (uint32_t)((uint64_t)tile_count * i / thread_count);
+		const uint32_t end = (uint32_t)((uint64_t)tile_count * (i + 1) / thread_count);
+		worker.range.store(pack_range(begin, end), std::memory_order_relaxed);
+		worker.tile_count = 0;
+		worker.steal_count = 0;
+		worker.failed_steal_count = 0;
+		worker.busy_sec = 0.0;
+	}
+	m_ray_count = 0;
+	m_busy_count = thread_count;
+	m_frame_id++;
+	m_work_cv.notify_all();
+
+	m_done_cv.wait(lock, [this]() { return m_busy_count == 0; });
+	lock.unlock();
+
+	const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint32_t steal_count = 0;
+	double idle_sec = 0.0;
+	for(uint32_t i = 0; i < thread_count; i++)
+	{
+		const CpuWorker& worker = m_worker_vec[i];
+		CpuThreadStats& stats = m_thread_stats_vec[i];
+		stats.tile_count += worker.tile_count;
+		stats.steal_count += worker.steal_count;
+		stats.failed_steal_count += worker.failed_steal_count;
+		stats.busy_ms += worker.busy_sec * 1e3;
+		stats.idle_ms += (sec - worker.busy_sec) * 1e3;
+
+		steal_count += worker.steal_count;
+		idle_sec += sec - worker.busy_sec;
+	}
+
+	const uint64_t sample_count = (uint64_t)m_width * (m_region[1] - m_region[0]);
+	if(m_profile_log != nullptr)
+		fprintf(m_profile_log, "{\"event\":\"frame\",\"sample\":%u,\"ms\":%.3f,\"samples_per_sec\":%.0f,\"rays_per_sec\":%.0f,\"steals\":%u,\"idle_pct\":%.2f}\n",
+			m_sample_idx, sec * 1e3, sample_count / sec, m_ray_count / sec, steal_count, 100.0 * idle_sec / (sec * thread_count));
+
+	m_sample_idx++;
+}
+
+void
+CpuRenderer::worker(uint32_t thread_idx)
+{
+	CpuWorker* self = &m_worker_vec[thread_idx];
+	uint32_t rng_state = pcg_hash(thread_idx + 1);
+
+	//reused for every tile the thread traces
+	RayStream stream = {};
+	if(m_wavefront)
+		create_ray_stream(&stream, cpu_tile_size * cpu_tile_size);
+
+	uint64_t seen_frame_id = 0;
+	for(;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_work_cv.wait(lock, [this, seen_frame_id]() { return m_quit || m_frame_id != seen_frame_id; });
+			if(m_quit)
+				break;
+			seen_frame_id = m_frame_id;
+		}
+
+		uint64_t ray_count = 0;
+		uint32_t order_idx;
+		while(pop_tile(self, &order_idx) || steal_tiles(thread_idx, &rng_state, &order_idx))
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			if(m_wavefront)
+				render_tile_wavefront(m_tile_order_vec[order_idx], &stream, &ray_count);
+			else
+				render_tile(m_tile_order_vec[order_idx], &ray_count);
+			self->busy_sec += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			self->tile_count++;
+		}
+		m_ray_count += ray_count;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if(--m_busy_count == 0)
+			m_done_cv.notify_one();
+	}
+
+	if(m_wavefront)
+		destroy_ray_stream(&stream);
+}
+
+//the next tile from the front of the thread's own range
+bool
+CpuRenderer::pop_tile(CpuWorker* self, uint32_t* order_idx)
+{
+	uint64_t range = self->range.load(std::memory_order_acquire);
+	for(;;)
+	{
+		const uint32_t begin = (uint32_t)range;
+		const uint32_t end = (uint32_t)(range >> 32);
+		if(begin >= end)
+			return false;
+
+		//a failed cas reloads range, a thief got there first
+		if(self->range.compare_exchange_weak(range, pack_range(begin + 1, end), std::memory_order_acq_rel, std::memory_order_acquire))
+		{
+			*order_idx = begin;
+			return true;
+		}
+	}
+}
+
+//takes the back half of the first non empty range found, starting from a random thread so thieves spread out
+//nothing ever adds tiles during a frame, so once every range is seen empty the thread is done
+//a thief that has won its cas but not yet stored its new range is missed by the scan, but it traces that range itself
+bool
+CpuRenderer::steal_tiles(uint32_t thread_idx, uint32_t* rng_state, uint32_t* order_idx)
+{
+	const uint32_t thread_count = (uint32_t)m_worker_vec.size();
+	CpuWorker* self = &m_worker_vec[thread_idx];
+
+	*rng_state = pcg_hash(*rng_state);
+	const uint32_t first = *rng_state % thread_count;
+	for(uint32_t i = 0; i < thread_count; i++)
+	{
+		const uint32_t victim_idx = (first + i) % thread_count;
+		if(victim_idx == thread_idx)
+			continue;
+
+		CpuWorker* victim = &m_worker_vec[victim_idx];
+		uint64_t range = victim->range.load(std::memory_order_acquire);
+		for(;;)
+		{
+			const uint32_t begin = (uint32_t)range;
+			const uint32_t end = (uint32_t)(range >> 32);
+			if(begin >= end)
+				break;
+
+			const uint32_t take = (end - begin + 1) / 2;
+			if(victim->range.compare_exchange_weak(range, pack_range(begin, end - take), std::memory_order_acq_rel, std::memory_order_acquire))
+			{
+				//the own range is empty, which no thief touches, so a plain store is enough
+				self->range.store(pack_range(end - take + 1, end), std::memory_order_release);
+				self->steal_count++;
+				*order_idx = end - take;
+				return true;
+			}
+			self->failed_steal_count++;
+		}
+	}
+	return false;
+}
+
+std::vector<CpuThreadStats>
+CpuRenderer::thread_stats() const
+{
+	return m_thread_stats_vec;
+}
+
+//tiles are a fixed grid over the whole image, those on the region's edge are clipped to it
+//rect is x begin, y begin, x end, y end
+void
+CpuRenderer::tile_rect(uint32_t tile_idx, uint32_t rect[4]) const
+{
+	rect[0] = tile_idx % m_tile_count_x * cpu_tile_size;
+	rect[1] = std::max(tile_idx / m_tile_count_x * cpu_tile_size, m_region[0]);
+	rect[2] = std::min(rect[0] + cpu_tile_size, (uint32_t)m_width);
+	rect[3] = std::min((tile_idx / m_tile_count_x + 1) * cpu_tile_size, m_region[1]);
+}
+
+void
+CpuRenderer::render_tile(uint32_t tile_idx, uint64_t* ray_count)
+{
+	uint32_t rect[4];
+	tile_rect(tile_idx, rect);
+	const uint32_t x_begin = rect[0];
+	const uint32_t x_end = rect[2];
+
+	const Vec3 origin = vec3(m_camera_frame.origin);
+	const uint32_t sample_seed = pcg_hash(m_sample_idx ^ m_seed);
+	const HitScene hs = { m_bvh_node_vec.data(), m_scene.sphere_vec.data(), m_sphere_soa, m_leaf_hit };
+
+	//primary rays of a run of neighbouring pixels go through the packet kernel together
+	//the bounces after them scatter in every direction, those are traced one ray at a time
+	const uint32_t run_width = m_packet_hit != nullptr ? m_packet_width : 1;
+
+	uint32_t rays = 0;
+	for(uint32_t y = rect[1]; y < rect[3]; y++)
+	{
+		for(uint32_t x_run = x_begin; x_run < x_end; x_run += run_width)
+		{
+			const uint32_t count = std::min(run_width, x_end - x_run);
+
+			uint32_t rng_state[max_packet_width];
+			Vec3 rd[max_packet_width];
+			for(uint32_t i = 0; i < count; i++)
+				rd[i] = primary_ray_dir(m_camera_frame, m_width, m_height, x_run + i, y, sample_seed, &rng_state[i]);
+
+			PrimaryHit primary[max_packet_width];
+			if(m_packet_hit != nullptr)
+			{
+				RayPacket packet;
+				packet.origin[0] = origin.x;
+				packet.origin[1] = origin.y;
+				packet.origin[2] = origin.z;
+				packet.count = count;
+				for(uint32_t i = 0; i < max_packet_width; i++)
+				{
+					const Vec3& dir = rd[i < count ? i : 0];
+					packet.dir[0][i] = dir.x;
+					packet.dir[1][i] = dir.y;
+					packet.dir[2][i] = dir.z;
+				}
+
+				float t_hit[max_packet_width];
+				uint32_t hit_idx[max_packet_width];
+				m_packet_hit(m_bvh_node_vec.data(), m_sphere_soa, packet, t_hit, hit_idx);
+				for(uint32_t i = 0; i < count; i++)
+					primary[i] = { t_hit[i], hit_idx[i] };
+			}
+
+			for(uint32_t i = 0; i < count; i++)
+			{
+				const Vec3 radiance = trace(m_scene, hs, origin, rd[i], &rng_state[i], &rays, m_packet_hit != nullptr ? &primary[i] : nullptr);
+
+				float* p = &m_accum_vec[((size_t)y * m_width + x_run + i) * 4];
+				p[0] += radiance.x;
+				p[1] += radiance.y;
+				p[2] += radiance.z;
+				p[3] += 1.0f;
+			}
+		}
+	}
+	*ray_count += rays;
+}
+
+
+//the same paths as render_tile, but a bounce at a time for every path of the tile
+//extend finds the next hit of every live path, shade adds its light, scatters it and packs the paths still alive to the front,
+//so each pass walks the stream's arrays from the start instead of jumping between paths
+void
+CpuRenderer::render_tile_wavefront(uint32_t tile_idx, RayStream* stream, uint64_t* ray_count)
+{
+	uint32_t rect[4];
+	tile_rect(tile_idx, rect);
+
+	const Vec3 origin = vec3(m_camera_frame.origin);
+	const uint32_t sample_seed = pcg_hash(m_sample_idx ^ m_seed);
+	const HitScene hs = { m_bvh_node_vec.data(), m_scene.sphere_vec.data(), m_sphere_soa, m_leaf_hit };
+
+	uint32_t count = 0;
+	for(uint32_t y = rect[1]; y < rect[3]; y++)
+	{
+		for(uint32_t x = rect[0]; x < rect[2]; x++)
+		{
+			store3(stream->origin, count, origin);
+			store3(stream->dir, count, primary_ray_dir(m_camera_frame, m_width, m_height, x, y, sample_seed, &stream->rng_state[count]));
+			store3(stream->throughput, count, vec3(1.0f, 1.0f, 1.0f));
+			store3(stream->radiance, count, vec3(0.0f, 0.0f, 0.0f));
+			stream->pixel[count] = y * m_width + x;
+			count++;
+		}
+	}
+
+	for(uint32_t bounce = 0; bounce <= m_scene.max_bounces && count > 0; bounce++)
+	{
+		//extend, primary rays all leave the camera so consecutive lanes already make packets
+		if(bounce == 0 && m_packet_hit != nullptr)
+		{
+			for(uint32_t base = 0; base < count; base += m_packet_width)
+			{
+				RayPacket packet;
+				packet.origin[0] = origin.x;
+				packet.origin[1] = origin.y;
+				packet.origin[2] = origin.z;
+				packet.count = std::min(m_packet_width, count - base);
+				for(uint32_t a = 0; a < 3; a++)
+				{
+					for(uint32_t i = 0; i < max_packet_width; i++)
+						packet.dir[a][i] = stream->dir[a][base + (i < packet.count ? i : 0)];
+				}
+
+				//the stream is padded to whole packets, so the lanes past count have somewhere to go
+				m_packet_hit(m_bvh_node_vec.data(), m_sphere_soa, packet, &stream->t[base], &stream->hit_idx[base]);
+			}
+		}
+		else
+		{
+			for(uint32_t i = 0; i < count; i++)
+				closest_hit(hs, load3(stream->origin, i), load3(stream->dir, i), &stream->t[i], &stream->hit_idx[i]);
+		}
+		*ray_count += count;
+
+		//shade, live paths are written back at live <= i so the pass can filter in place
+		uint32_t live = 0;
+		for(uint32_t i = 0; i < count; i++)
+		{
+			Vec3 rd = load3(stream->dir, i);
+			Vec3 throughput = load3(stream->throughput, i);
+			Vec3 radiance = load3(stream->radiance, i);
+			uint32_t rng_state = stream->rng_state[i];
+
+			bool alive = false;
+			Vec3 p;
+			if(stream->t[i] < t_max)
+			{
+				const Sphere& s = m_scene.sphere_vec[stream->hit_idx[i]];
+				p = load3(stream->origin, i) + rd * stream->t[i];
+				const Vec3 n = (p - vec3(s.center)) / s.radius;
+				const bool front = dot(rd, n) < 0.0f;
+				const Vec3 ffn = front ? n : -n;
+
+				radiance = radiance + throughput * vec3(s.emission);
+
+				if(scatter(s, front, ffn, &rd, &rng_state))
+				{
+					throughput = throughput * vec3(s.albedo);
+					alive = max(throughput.x, max(throughput.y, throughput.z)) > 0.0f;
+				}
+			}
+			else
+				radiance = radiance + throughput * sky(rd);
+
+			if(alive && bounce < m_scene.max_bounces)
+			{
+				store3(stream->origin, live, p);
+				store3(stream->dir, live, rd);
+				store3(stream->throughput, live, throughput);
+				store3(stream->radiance, live, radiance);
+				stream->rng_state[live] = rng_state;
+				stream->pixel[live] = stream->pixel[i];
+				live++;
+			}
+			else
+			{
+				float* accum = &m_accum_vec[(size_t)stream->pixel[i] * 4];
+				accum[0] += radiance.x;
+				accum[1] += radiance.y;
+				accum[2] += radiance.z;
+				accum[3] += 1.0f;
+			}
+		}
+		count = live;
+	}
+}
+
+//moving the camera invalidates everything accumulated so far
+void
+CpuRenderer::set_camera(const Camera& camera)
+{
+	m_scene.camera = camera;
+	make_camera_frame(m_scene.camera, m_width, m_height, &m_camera_frame);
+	std::fill(m_accum_vec.begin(), m_accum_vec.end(), 0.0f);
+	m_sample_idx = 0;
+}
+
+void
+CpuRenderer::set_region(uint32_t row_begin, uint32_t row_end)
+{
+	if(row_end > (uint32_t)m_height)
+		row_end = m_height;
+	if(row_begin >= row_end)
+		row_begin = row_end > 0 ? row_end - 1 : 0;
+
+	m_region[0] = row_begin;
+	m_region[1] = row_end;
+}
+
+void
+CpuRenderer::set_seed(uint32_t seed)
+{
+	m_seed = seed;
+}
+
+
+//frames finish before render_frame returns, so there is nothing to wait for
+bool
+CpuRenderer::save_image(const char* path)
+{
+	return write_image(path, m_accum_vec.data(), m_width, m_height);
+}
+
+bool
+CpuRenderer::read_accum(float* dst)
+{
+	memcpy(dst, m_accum_vec.data(), m_accum_vec.size() * sizeof(float));
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+#pragma once
+#include "bvh.h"
+#include "cpu_packet.h"
+#include "scene.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//totals for one pool thread since init, idle is the part of each frame's wall time it wasn't tracing a tile
+struct CpuThreadStats
+{
+	uint64_t tile_count;
+	uint64_t steal_count; //ranges taken from another thread
+	uint64_t failed_steal_count; //lost the race for a range to its owner or another thief
+	double busy_ms;
+	double idle_ms;
+};
+
+//a thread's share of a frame, a range of m_tile_order_vec packed as begin | end << 32 so it can be changed with one cas
+//the owner takes tiles from the front, thieves take the back half
+//own cache line each, so a thread taking its next tile doesn't invalidate its neighbour's
+struct alignas(64) CpuWorker
+{
+	std::atomic<uint64_t> range;
+
+	//written by the owner during a frame, read by render_frame once every thread is done with it
+	uint32_t tile_count;
+	uint32_t steal_count;
+	uint32_t failed_steal_count;
+	double busy_sec;
+};
+
+//one tile's live paths in the wavefront mode, an array per field so a pass over a field reads consecutive lanes
+//every array starts on a cache line and is padded to a whole number of the widest packet
+struct RayStream
+{
+	float* origin[3];
+	float* dir[3];
+	float* throughput[3];
+	float* radiance[3]; //gathered so far, added to the pixel when the path ends
+	float* t; //of the last extend, t_max for a miss
+	uint32_t* hit_idx;
+	uint32_t* rng_state;
+	uint32_t* pixel;
+	uint32_t capacity;
+	void* storage; //every array above lives in this one allocation
+};
+
+//traces the same paths as path.comp on the host, for machines without a vulkan device
+//the accumulation buffer has the same layout as the gpu one, so images from either can be merged or compared
+class CpuRenderer
+{
+public:
+	//wavefront traces each tile a bounce at a time through a RayStream instead of a path at a time, the image is the same
+	CpuRenderer(const char* render_name, int width, int height, bool wavefront = false);
+	~CpuRenderer();
+
+	void init();
+	void quit();
+
+	void render_frame();
+	void set_camera(const Camera& camera);
+
+	//same meaning as on Renderer
+	void set_region(uint32_t row_begin, uint32_t row_end);
+	void set_seed(uint32_t seed);
+
+	bool save_image(const char* path);
+	bool read_accum(float* dst);
+
+	std::vector<CpuThreadStats> thread_stats() const;
+
+private:
+	void build_sphere_soa();
+	void order_tiles();
+	void worker(uint32_t thread_idx);
+	bool pop_tile(CpuWorker* self, uint32_t* order_idx);
+	bool steal_tiles(uint32_t thread_idx, uint32_t* rng_state, uint32_t* order_idx);
+	void tile_rect(uint32_t tile_idx, uint32_t rect[4]) const;
+	void render_tile(uint32_t tile_idx, uint64_t* ray_count);
+	void render_tile_wavefront(uint32_t tile_idx, RayStream* stream, uint64_t* ray_count);
+
+private:
+	const char* const m_render_name;
+	const int m_width;
+	const int m_height;
+	const bool m_wavefront;
+
+	Scene m_scene;
+	std::vector<BvhNode> m_bvh_node_vec;
+	CameraFrame m_camera_frame;
+
+	//m_sphere_soa's arrays, one after the other
+	std::vector<float> m_sphere_soa_vec;
+	SphereSoa m_sphere_soa;
+
+	//rgb radiance sum + sample count per pixel, like the gpu's accumulation buffer
+	std::vector<float> m_accum_vec;
+
+	uint32_t m_region[2]; //rows [begin, end) traced by each frame
+	uint32_t m_sample_idx = 0;
+	uint32_t m_seed = 0x9e3779b9;
+
+	//the pool's threads sleep until render_frame hands them a new frame, then take tiles until there are none left
+	std::vector<std::thread> m_thread_vec;
+	std::mutex m_mutex;
+	std::condition_variable m_work_cv;
+	std::condition_variable m_done_cv;
+	uint64_t m_frame_id = 0;
+	uint32_t m_busy_count = 0;
+	bool m_quit = false;
+
+	//the region's tiles in z order, so each thread's range and every stolen half of one is a compact block of the image
+	uint32_t m_tile_count_x = 0;
+	std::vector<uint32_t> m_tile_order_vec;
+	uint32_t m_order_region[2] = { 0, 0 }; //the region m_tile_order_vec was built for
+
+	std::vector<CpuWorker> m_worker_vec;
+	std::vector<CpuThreadStats> m_thread_stats_vec;
+	std::atomic<uint64_t> m_ray_count;
+
+	PacketIsa m_packet_isa = PACKET_ISA_SCALAR;
+	PacketHitFunc m_packet_hit = nullptr; //null for scalar
+	LeafHitFunc m_leaf_hit = nullptr; //null for scalar
+	uint32_t m_packet_width = 1;
+
+	FILE* m_profile_log = nullptr;
+};
\ No newline at end of file
@@ -0,0 +1,294 @@
+#include "image.h"
+
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+static void
+resolve_pixel(const float* accum, size_t idx, float rgb[3])
+{
+	const float* p = accum + idx * 4;
+	const float inv = p[3] > 0.0f ? 1.0f / p[3] : 0.0f;
+	rgb[0] = p[0] * inv;
+	rgb[1] = p[1] * inv;
+	rgb[2] = p[2] * inv;
+}
+
+static bool
+has_extension(const char* path, const char* ext)
+{
+	const size_t path_len = strlen(path);
+	const size_t ext_len = strlen(ext);
+	if(path_len < ext_len)
+		return false;
+
+	for(size_t i = 0; i < ext_len; i++)
+	{
+		char c = path[path_len - ext_len + i];
+		if(c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		if(c != ext[i])
+			return false;
+	}
+	return true;
+}
+
+
+//pfm stores rows bottom to top, little endian is flagged by the negative scale
+static bool
+write_pfm(FILE* file, const float* accum, int width, int height)
+{
+	fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+
+	std::vector<float> row((size_t)width * 3);
+	for(int y = height - 1; y >= 0; y--)
+	{
+		for(int x = 0; x < width; x++)
+			resolve_pixel(accum, (size_t)y * width + x, &row[(size_t)x * 3]);
+
+		if(fwrite(row.data(), sizeof(float), row.size(), file) != row.size())
+			return false;
+	}
+	return true;
+}
+
+
+static void
+put_u32(std::vector<uint8_t>& out, uint32_t v)
+{
+	for(int i = 0; i < 4; i++)
+		out.push_back((uint8_t)(v >> (i * 8)));
+}
+
+static void
+put_attr(std::vector<uint8_t>& out, const char* name, const char* type, const void* data, uint32_t size)
+{
+	out.insert(out.end(), name, name + strlen(name) + 1);
+	out.insert(out.end(), type, type + strlen(type) + 1);
+	put_u32(out, size);
+	out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+}
+
+//uncompressed single part scanline exr with 32 bit float channels
+static bool
+write_exr(FILE* file, const float* accum, int width, int height)
+{
+	std::vector<uint8_t> header;
+	const uint8_t magic[] = { 0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0 };
+	header.insert(header.end(), magic, magic + sizeof(magic));
+
+	//channels have to be listed alphabetically
+	std::vector<uint8_t> chlist;
+	const char* channel_names[] = { "B", "G", "R" };
+	for(const char* name : channel_names)
+	{
+		chlist.insert(chlist.end(), name, name + 2);
+		put_u32(chlist, 2); //FLOAT
+		put_u32(chlist, 0); //pLinear + reserved
+		put_u32(chlist, 1); //x sampling
+		put_u32(chlist, 1); //y sampling
+	}
+	chlist.push_back(0);
+	put_attr(header, "channels", "chlist", chlist.data(), (uint32_t)chlist.size());
+
+	const uint8_t compression = 0;
+	put_attr(header, "compression", "compression", &compression, 1);
+
+	const int32_t window[4] = { 0, 0, width - 1, height - 1 };
+	put_attr(header, "dataWindow", "box2i", window, sizeof(window));
+	put_attr(header, "displayWindow", "box2i", window, sizeof(window));
+
+	const uint8_t line_order = 0; //INCREASING_Y
+	put_attr(header, "lineOrder", "lineOrder", &line_order, 1);
+
+	const float aspect = 1.0f;
+	put_attr(header, "pixelAspectRatio", "float", &aspect, sizeof(aspect));
+
+	const float center[2] = { 0.0f, 0.0f };
+	put_attr(header, "screenWindowCenter", "v2f", center, sizeof(center));
+
+	const float window_width = 1.0f;
+	put_attr(header, "screenWindowWidth", "float", &window_width, sizeof(window_width));
+	header.push_back(0);
+
+	const uint32_t line_size = (uint32_t)width * 3 * sizeof(float);
+	const uint64_t first_line = header.size() + (uint64_t)height * sizeof(uint64_t);
+
+	std::vector<uint64_t> offset_table(height);
+	for(int y = 0; y < height; y++)
+		offset_table[y] = first_line + (uint64_t)y * (8 + line_size);
+
+	if(fwrite(header.data(), 1, header.size(), file) != header.size() ||
+		fwrite(offset_table.data(), sizeof(uint64_t), offset_table.size(), file) != offset_table.size())
+		return false;
+
+	//each line is its y coordinate, its byte count, then every pixel of one channel after the other
+	std::vector<float> line((size_t)width * 3);
+	for(int y = 0; y < height; y++)
+	{
+		for(int x = 0; x < width; x++)
+		{
+			float rgb[3];
+			resolve_pixel(accum, (size_t)y * width + x, rgb);
+			line[x] = rgb[2];
+			line[width + x] = rgb[1];
+			line[2 * width + x] = rgb[0];
+		}
+
+		const int32_t line_header[2] = { y, (int32_t)line_size };
+		if(fwrite(line_header, sizeof(line_header), 1, file) != 1 ||
+			fwrite(line.data(), sizeof(float), line.size(), file) != line.size())
+			return false;
+	}
+	return true;
+}
+
+
+static uint32_t
+crc32(const uint8_t* data, size_t size, uint32_t crc = 0)
+{
+	//built on first use by a thread safe static initializer, images can be written from the writer thread
+	static const std::array<uint32_t, 256> table = []()
+	{
+		std::array<uint32_t, 256> t = {};
+		for(uint32_t n = 0; n < 256; n++)
+		{
+			uint32_t c = n;
+			for(int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+			t[n] = c;
+		}
+		return t;
+	}();
+
+	crc = ~crc;
+	for(size_t i = 0; i < size; i++)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void
+put_u32_be(std::vector<uint8_t>& out, uint32_t v)
+{
+	for(int i = 3; i >= 0; i--)
+		out.push_back((uint8_t)(v >> (i * 8)));
+}
+
+static bool
+write_png_chunk(FILE* file, const char* type, const std::vector<uint8_t>& data)
+{
+	std::vector<uint8_t> chunk;
+	put_u32_be(chunk, (uint32_t)data.size());
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	put_u32_be(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+	return fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+}
+
+static uint8_t
+to_srgb8(float v)
+{
+	v = v / (1.0f + v); //reinhard, keeps highlights from clipping hard
+	v = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+	v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+	return (uint8_t)(v * 255.0f + 0.5f);
+}
+
+//8 bit rgb, zlib stream made of stored deflate blocks
+//output is larger than a compressing encoder's but costs next to nothing to produce
+static bool
+write_png(FILE* file, const float* accum, int width, int height)
+{
+	const uint8_t signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if(fwrite(signature, 1, sizeof(signature), file) != sizeof(signature))
+		return false;
+
+	std::vector<uint8_t> ihdr;
+	put_u32_be(ihdr, width);
+	put_u32_be(ihdr, height);
+	ihdr.push_back(8); //bit depth
+	ihdr.push_back(2); //truecolor
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	ihdr.push_back(0);
+	if(!write_png_chunk(file, "IHDR", ihdr))
+		return false;
+
+	const size_t row_size = 1 + (size_t)width * 3;
+	std::vector<uint8_t> raw(row_size * height);
+	for(int y = 0; y < height; y++)
+	{
+		uint8_t* row = &raw[row_size * y];
+		row[0] = 0; //no filter
+		for(int x = 0; x < width; x++)
+		{
+			float rgb[3];
+			resolve_pixel(accum, (size_t)y * width + x, rgb);
+			row[1 + x * 3 + 0] = to_srgb8(rgb[0]);
+			row[1 + x * 3 + 1] = to_srgb8(rgb[1]);
+			row[1 + x * 3 + 2] = to_srgb8(rgb[2]);
+		}
+	}
+
+	std::vector<uint8_t> zlib;
+	zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	zlib.push_back(0x78);
+	zlib.push_back(0x01);
+
+	uint32_t adler_a = 1, adler_b = 0;
+	size_t pos = 0;
+	do
+	{
+		const size_t block = raw.size() - pos > 65535 ? 65535 : raw.size() - pos;
+		zlib.push_back(pos + block == raw.size() ? 1 : 0);
+		zlib.push_back((uint8_t)(block & 0xff));
+		zlib.push_back((uint8_t)(block >> 8));
+		zlib.push_back((uint8_t)(~block & 0xff));
+		zlib.push_back((uint8_t)((~block >> 8) & 0xff));
+		zlib.insert(zlib.end(), raw.begin() + pos, raw.begin() + pos + block);
+
+		for(size_t i = pos; i < pos + block; i++)
+		{
+			adler_a = (adler_a + raw[i]) % 65521;
+			adler_b = (adler_b + adler_a) % 65521;
+		}
+		pos += block;
+	} while(pos < raw.size());
+
+	put_u32_be(zlib, (adler_b << 16) | adler_a);
+
+	return write_png_chunk(file, "IDAT", zlib) && write_png_chunk(file, "IEND", std::vector<uint8_t>());
+}
+
+
+bool
+write_image(const char* path, const float* accum, int width, int height)
+{
+	FILE* file = fopen(path, "wb");
+	if(file == nullptr)
+	{
+		fprintf(stderr, "failed to open %s for writing!\n", path);
+		return false;
+	}
+
+	bool ok;
+	if(has_extension(path, ".pfm"))
+		ok = write_pfm(file, accum, width, height);
+	else if(has_extension(path, ".exr"))
+		ok = write_exr(file, accum, width, height);
+	else if(has_extension(path, ".png"))
+		ok = write_png(file, accum, width, height);
+	else
+	{
+		fprintf(stderr, "unknown image format for %s, expected .png, .exr or .pfm!\n", path);
+		ok = false;
+	}
+
+	ok = fclose(file) == 0 && ok;
+	if(!ok)
+		fprintf(stderr, "failed to write %s!\n", path);
+	return ok;
+}
\ No newline at end of file
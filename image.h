@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+//writes an accumulation buffer (rgb radiance sum + sample count per pixel, row 0 at the top) as an image
+//the format is picked from the extension: .pfm and .exr keep linear float radiance, .png is tonemapped to 8 bit srgb
+bool write_image(const char* path, const float* accum, int width, int height);
\ No newline at end of file
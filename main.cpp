@@ -1,18 +1,83 @@
 #include "render.h"
+#include "multi_render.h"
+#include "cpu_render.h"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
 
+
+//every renderer looks the same from here
+template<typename R>
+static void
+render(R* renderer, const char* image_path)
+{
+	renderer->init();
+
+	const int sample_count = 64;
+	for(int i = 0; i < sample_count; i++)
+		renderer->render_frame();
+
+	renderer->save_image(image_path);
+
+	renderer->quit();
+}
+
 int 
 main(void)
 {
-	Renderer renderer("Sphere", 1280, 720, false);
-	renderer.init();
+	//RP_SCENE picks the scene by name, Sphere or Particles, the image is named after it
+	const char* scene_name = getenv("RP_SCENE");
+	if(scene_name == nullptr)
+		scene_name = "Sphere";
+	char image_path[256];
+	snprintf(image_path, sizeof(image_path), "%s.png", scene_name);
 
+	//RP_INTEGRATOR=wavefront switches from the single path tracing kernel to the staged one
+	const char* integrator_name = getenv("RP_INTEGRATOR");
+	const Integrator integrator = integrator_name != nullptr && strcmp(integrator_name, "wavefront") == 0 ? INTEGRATOR_WAVEFRONT : INTEGRATOR_MEGAKERNEL;
 
+	//RP_BACKEND=cpu traces on the host with every core, it is also what runs when there is no vulkan device
+	const char* backend = getenv("RP_BACKEND");
+	const bool use_cpu = backend != nullptr ? strcmp(backend, "cpu") == 0 : !vulkan_available();
+	if(use_cpu)
+	{
+		if(backend == nullptr)
+			fprintf(stderr, "WARNING: no vulkan device found, rendering on the cpu\n");
 
-	renderer.quit();
-	return 0;
-}
+		CpuRenderer renderer(scene_name, 1280, 720, integrator == INTEGRATOR_WAVEFRONT);
+		render(&renderer, image_path);
+		return 0;
+	}
 
+	//RP_DEVICES splits the frame over several devices, "all" or a list of device indices like 0,1 or 0,0
+	if(const char* devices = getenv("RP_DEVICES"))
+	{
+		std::vector<uint32_t> pdev_idx_vec;
+		if(strcmp(devices, "all") != 0)
+		{
+			const char* pos = devices;
+			for(;;)
+			{
+				char* end;
+				const unsigned long idx = strtoul(pos, &end, 10);
+				if(end == pos)
+					break;
+				pdev_idx_vec.push_back((uint32_t)idx);
+				if(*end != ',')
+					break;
+				pos = end + 1;
+			}
+		}
 
+		MultiRenderer renderer(scene_name, 1280, 720, integrator, pdev_idx_vec);
+		render(&renderer, image_path);
+		return 0;
+	}
 
+	Renderer renderer(scene_name, 1280, 720, false, integrator);
+	render(&renderer, image_path);
+	return 0;
+}
\ No newline at end of file
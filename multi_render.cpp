@@ -0,0 +1,164 @@
+#include "multi_render.h"
+#include "image.h"
+
+#include <chrono>
+#include <cstdio>
+#include <thread>
+
+
+//no band gets thinner than this, so a device that was slow once still gets measured again
+static const uint32_t min_band_rows = 8;
+
+//weight of the latest frame in the smoothed rates
+static const double rate_smoothing = 0.5;
+
+
+MultiRenderer::MultiRenderer(const char* render_name, int width, int height, Integrator integrator, const std::vector<uint32_t>& pdev_idx_vec) : 
+	m_render_name(render_name), m_width(width), m_height(height), m_integrator(integrator), m_pdev_idx_vec(pdev_idx_vec) {}
+MultiRenderer::~MultiRenderer(){}
+
+
+void
+MultiRenderer::init()
+{
+	if(m_pdev_idx_vec.empty())
+	{
+		//the first renderer's instance is what counts the devices
+		Renderer* first = new Renderer(m_render_name, m_width, m_height, false, m_integrator);
+		first->set_device(0);
+		first->init();
+		m_renderer_vec.push_back(first);
+
+		const uint32_t pdev_count = first->device_count();
+		for(uint32_t i = 0; i < pdev_count; i++)
+			m_pdev_idx_vec.push_back(i);
+	}
+
+	//every band needs min_band_rows, a renderer given an empty one would still trace a row and count it twice in the merge
+	const size_t max_renderer_count = m_height / min_band_rows > 0 ? m_height / min_band_rows : 1;
+	if(m_pdev_idx_vec.size() > max_renderer_count)
+	{
+		fprintf(stderr, "WARNING: %d rows are only enough for %zu devices, leaving out the rest\n", m_height, max_renderer_count);
+		m_pdev_idx_vec.resize(max_renderer_count);
+	}
+
+	for(size_t i = m_renderer_vec.size(); i < m_pdev_idx_vec.size(); i++)
+	{
+		Renderer* renderer = new Renderer(m_render_name, m_width, m_height, false, m_integrator);
+		renderer->set_device(m_pdev_idx_vec[i]);
+		renderer->init();
+		m_renderer_vec.push_back(renderer);
+	}
+
+	//a device taking over rows from another must not trace the same samples again
+	for(size_t i = 0; i < m_renderer_vec.size(); i++)
+		m_renderer_vec[i]->set_seed(0x9e3779b9u + (uint32_t)i * 0x632be5abu);
+
+	m_row_count_vec.assign(m_renderer_vec.size(), 0);
+	m_frame_sec_vec.assign(m_renderer_vec.size(), 0.0);
+	m_row_rate_vec.assign(m_renderer_vec.size(), 0.0);
+	balance_regions();
+}
+
+void
+MultiRenderer::quit()
+{
+	for(Renderer* renderer : m_renderer_vec)
+	{
+		renderer->quit();
+		delete renderer;
+	}
+	m_renderer_vec.clear();
+}
+
+
+//one sample for every pixel, each device driven from its own thread so one waiting on its fences doesn't hold up the rest
+void
+MultiRenderer::render_frame()
+{
+	std::vector<std::thread> thread_vec;
+	for(size_t i = 0; i < m_renderer_vec.size(); i++)
+	{
+		thread_vec.emplace_back([this, i]()
+		{
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			m_renderer_vec[i]->render_frame();
+			m_frame_sec_vec[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		});
+	}
+	for(std::thread& thread : thread_vec)
+		thread.join();
+
+	balance_regions();
+}
+
+//bands in device order from the top, sized by rate so every device should take as long over its band
+//until every device has been timed they are all the same size
+void
+MultiRenderer::balance_regions()
+{
+	const size_t renderer_count = m_renderer_vec.size();
+
+	bool all_measured = true;
+	double rate_sum = 0.0;
+	for(size_t i = 0; i < renderer_count; i++)
+	{
+		if(m_frame_sec_vec[i] > 0.0 && m_row_count_vec[i] > 0)
+		{
+			const double rate = m_row_count_vec[i] / m_frame_sec_vec[i];
+			m_row_rate_vec[i] = m_row_rate_vec[i] > 0.0 ? m_row_rate_vec[i] * (1.0 - rate_smoothing) + rate * rate_smoothing : rate;
+		}
+		all_measured = all_measured && m_row_rate_vec[i] > 0.0;
+		rate_sum += m_row_rate_vec[i];
+	}
+
+	uint32_t row = 0;
+	for(size_t i = 0; i < renderer_count; i++)
+	{
+		const uint32_t rows_left = m_height - row;
+		const uint32_t reserved = min_band_rows * (uint32_t)(renderer_count - i - 1);
+
+		uint32_t rows = rows_left;
+		if(i + 1 < renderer_count)
+		{
+			const double share = all_measured ? m_row_rate_vec[i] / rate_sum : 1.0 / renderer_count;
+			rows = (uint32_t)(m_height * share + 0.5);
+			if(rows < min_band_rows)
+				rows = min_band_rows;
+			if(rows + reserved > rows_left)
+				rows = rows_left > reserved ? rows_left - reserved : 0;
+		}
+
+		m_renderer_vec[i]->set_region(row, row + rows);
+		m_row_count_vec[i] = rows;
+		row += rows;
+	}
+}
+
+
+void
+MultiRenderer::set_camera(const Camera& camera)
+{
+	for(Renderer* renderer : m_renderer_vec)
+		renderer->set_camera(camera);
+}
+
+//waits for every device's copy, unlike Renderer::save_image
+bool
+MultiRenderer::save_image(const char* path)
+{
+	const size_t float_count = (size_t)m_width * m_height * 4;
+	std::vector<float> merged(float_count, 0.0f);
+	std::vector<float> accum(float_count);
+
+	for(Renderer* renderer : m_renderer_vec)
+	{
+		if(!renderer->read_accum(accum.data()))
+			return false;
+
+		for(size_t i = 0; i < float_count; i++)
+			merged[i] += accum[i];
+	}
+
+	return write_image(path, merged.data(), m_width, m_height);
+}
\ No newline at end of file
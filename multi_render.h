@@ -0,0 +1,41 @@
+#pragma once
+#include "render.h"
+#include "scene.h"
+
+#include <cstdint>
+#include <vector>
+
+//split frame rendering, one Renderer per device, each sweeping its own band of rows
+//the bands are resized after every frame from how fast each device got through its last one
+//an accumulation is a sum and a sample count per pixel, so the merged image is just the sum of all of them,
+//however often the bands moved
+class MultiRenderer
+{
+public:
+	//an empty pdev_idx_vec means every physical device, an index can repeat to run several logical devices on one adapter
+	MultiRenderer(const char* render_name, int width, int height, Integrator integrator, const std::vector<uint32_t>& pdev_idx_vec);
+	~MultiRenderer();
+
+	void init();
+	void quit();
+
+	void render_frame();
+	void set_camera(const Camera& camera);
+
+	bool save_image(const char* path);
+
+private:
+	void balance_regions();
+
+private:
+	const char* const m_render_name;
+	const int m_width;
+	const int m_height;
+	const Integrator m_integrator;
+	std::vector<uint32_t> m_pdev_idx_vec;
+
+	std::vector<Renderer*> m_renderer_vec;
+	std::vector<uint32_t> m_row_count_vec; //rows in each device's band
+	std::vector<double> m_frame_sec_vec; //how long each device took over its band last frame
+	std::vector<double> m_row_rate_vec; //rows per second, smoothed over frames, 0 until measured
+};
\ No newline at end of file
@@ -1,25 +1,96 @@
 #include "render.h"
+#include "image.h"
+#include "shaders.h"
 #include "volk.h"
 
 #include <vulkan/vulkan.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <string>
 #include <vector>
 #include <set>
 
-Renderer::Renderer(const char* render_name, int width, int height, bool display_live) : m_render_name(render_name), m_width(width), m_height(height), m_display_live(display_live) {}
+#include <unistd.h>
+
+Renderer::Renderer(const char* render_name, int width, int height, bool display_live, Integrator integrator) : m_render_name(render_name), m_width(width), m_height(height), m_display_live(display_live), m_integrator(integrator), m_writer_done(false)
+{
+	m_region[1] = height;
+}
 Renderer::~Renderer(){}
 
 
 #define CHECKVK(expr, msg) if((expr) != VK_SUCCESS){fprintf(stderr, "%s:%d - %s\n", __FILE__, __LINE__, msg); exit(1);}
 
-//for shaders
+//choose_pdev times each device on a frame this size, after one untimed frame
+static const int calibration_width = 320;
+static const int calibration_height = 180;
+static const int calibration_frames = 8;
+
+static const size_t staging_ring_size = 64 * 1024 * 1024;
+static const size_t min_staging_ring_size = 4 * 1024 * 1024;
+static const size_t staging_alignment = 16;
+
+//a begin and end timestamp per dispatch or per copy
+static const uint32_t max_timed_dispatches = 64;
+static const uint32_t max_timed_copies = 256;
+static const uint32_t c_queries_per_slot = max_timed_dispatches * 2;
+
+//tile sizing, used until the first submission has been timed and forever if the compute queue has no timestamps
+static const double default_tile_budget_ms = 25.0;
+static const uint64_t default_tile_pixels = 256 * 256;
+static const double tile_budget_headroom = 0.8;
+
+//the wavefront integrator keeps up to this many paths in memory, which caps its tile size
+//per path: PathState 48, two Rays of 32, Hit 8 and two ShadowRays of 48 bytes, see wavefront.glsl
+static const uint32_t wavefront_path_capacity = 1 << 20;
+static const uint32_t min_wavefront_path_capacity = 1 << 16;
+static const size_t path_state_size = 48;
+static const size_t ray_size = 32;
+static const size_t hit_size = 8;
+static const size_t shadow_ray_size = 48;
+static const size_t path_queue_bytes = path_state_size + 2 * ray_size + hit_size + 2 * shadow_ray_size;
+
+//device memory, share of what is left over that the path queues may take, and how often to look at the budget again
+static const double path_queue_budget_share = 0.5;
+static const uint64_t budget_check_interval = 16;
+
+//room for each of the frame pool's buffers to be aligned within its block
+static const VkDeviceSize frame_pool_alignment_slack = 64 * 1024;
+
+static const char* const pool_name_array[POOL_COUNT] = {
+	"default",
+	"scene",
+	"frame",
+	"staging",
+};
+
+//QueueCounts in wavefront.glsl, one per bounce parity
+static const size_t queue_counts_size = 32;
+static const size_t ray_dispatch_offset = 0;
+static const size_t shadow_dispatch_offset = 16;
+
+static const char* const wavefront_kernel_name_array[WF_STAGE_COUNT] = {
+	"wf_generate.comp",
+	"wf_extend.comp",
+	"wf_shade.comp",
+	"wf_compact.comp",
+	"wf_connect.comp",
+};
+
+//for shaders and the pipeline cache
 void*
 read_binary(const char* path, size_t* size)
 {
 	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if(!file.is_open())
+		return nullptr;
+
 	std::streamsize fsize = file.tellg();
 	*size = (size_t)fsize;
 
@@ -35,6 +106,35 @@ read_binary(const char* path, size_t* size)
 }
 
 
+//a bare instance, without the validation layer Renderer asks for, so hosts without the sdk still count
+bool
+vulkan_available()
+{
+	if(volkInitialize() != VK_SUCCESS)
+		return false;
+
+	VkInstanceCreateInfo instance_cinfo;
+	instance_cinfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instance_cinfo.pNext = nullptr;
+	instance_cinfo.flags = 0;
+	instance_cinfo.pApplicationInfo = nullptr;
+	instance_cinfo.enabledLayerCount = 0;
+	instance_cinfo.ppEnabledLayerNames = nullptr;
+	instance_cinfo.enabledExtensionCount = 0;
+	instance_cinfo.ppEnabledExtensionNames = nullptr;
+
+	VkInstance instance;
+	if(vkCreateInstance(&instance_cinfo, nullptr, &instance) != VK_SUCCESS)
+		return false;
+	volkLoadInstance(instance);
+
+	uint32_t pdev_count = 0;
+	vkEnumeratePhysicalDevices(instance, &pdev_count, nullptr);
+	vkDestroyInstance(instance, nullptr);
+	return pdev_count > 0;
+}
+
+
 void
 Renderer::create_instance()
 {
@@ -57,7 +157,15 @@ Renderer::create_instance()
 	appinfo.applicationVersion = 1;
 	appinfo.pEngineName = "RayPath";
 	appinfo.engineVersion = 1;
-	appinfo.apiVersion = VK_API_VERSION_1_0;
+	//1.1 where the loader has it, for the subgroup properties, a 1.0 loader rejects anything newer
+	m_instance_api_version = VK_API_VERSION_1_0;
+	if(vkEnumerateInstanceVersion != nullptr)
+	{
+		uint32_t loader_version;
+		if(vkEnumerateInstanceVersion(&loader_version) == VK_SUCCESS && loader_version >= VK_API_VERSION_1_1)
+			m_instance_api_version = VK_API_VERSION_1_1;
+	}
+	appinfo.apiVersion = m_instance_api_version;
 
 
 	VkInstanceCreateInfo instance_cinfo;
@@ -74,6 +182,8 @@ Renderer::create_instance()
 	volkLoadInstance(m_instance);
 }
 
+//RP_DEVICE pins a device by index or by part of its name
+//otherwise, with more than one to choose from, each is timed on the path kernel and the fastest wins
 void
 Renderer::choose_pdev()
 {
@@ -85,39 +195,162 @@ Renderer::choose_pdev()
 	CHECKVK(vkEnumeratePhysicalDevices(m_instance, &pdev_count, pdev_vec.data()), 
 		"Failed to enumerate physical devices");
 
-	std::vector<VkPhysicalDevice> ideal_pdev_vec;
+	uint32_t pdev_idx = UINT32_MAX;
+	if(m_pinned_pdev_idx >= 0 && (uint32_t)m_pinned_pdev_idx < pdev_count)
+		pdev_idx = (uint32_t)m_pinned_pdev_idx;
+	else if(const char* pin = getenv("RP_DEVICE"))
+	{
+		char* end;
+		const unsigned long idx = strtoul(pin, &end, 10);
+		for(uint32_t i = 0; i < pdev_count && pdev_idx == UINT32_MAX; i++)
+		{
+			VkPhysicalDeviceProperties props;
+			vkGetPhysicalDeviceProperties(pdev_vec[i], &props);
+			if((*end == '\0' && end != pin) ? idx == i : strstr(props.deviceName, pin) != nullptr)
+				pdev_idx = i;
+		}
+		if(pdev_idx == UINT32_MAX)
+			fprintf(stderr, "WARNING: no device matches RP_DEVICE=%s\n", pin);
+	}
+
+	if(pdev_idx == UINT32_MAX && pdev_count > 1)
+	{
+		double best_score = 0.0;
+		for(uint32_t i = 0; i < pdev_count; i++)
+		{
+			const double score = benchmark_pdev(pdev_vec[i], i);
+			if(score > best_score)
+			{
+				best_score = score;
+				pdev_idx = i;
+			}
+		}
+
+		//the probes pointed volk at their own instances
+		volkLoadInstance(m_instance);
+	}
 
-	for(VkPhysicalDevice pdev : pdev_vec)
+	if(pdev_idx == UINT32_MAX)
 	{
-		VkPhysicalDeviceProperties props;
-		vkGetPhysicalDeviceProperties(pdev, &props);
-		if(props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
-			ideal_pdev_vec.push_back(pdev);
+		for(uint32_t i = 0; i < pdev_count && pdev_idx == UINT32_MAX; i++)
+		{
+			VkPhysicalDeviceProperties props;
+			vkGetPhysicalDeviceProperties(pdev_vec[i], &props);
+			if(props.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)
+				pdev_idx = i;
+		}
 	}
 
-	if(ideal_pdev_vec.empty())
+	if(pdev_idx == UINT32_MAX)
 	{
 		fprintf(stderr, "WARNING: failed to find discrete gpu, using alternative...\n");
-		m_pdev = pdev_vec[0];
+		pdev_idx = 0;
 	}
-	else
-		m_pdev = ideal_pdev_vec[0];
 
+	m_pdev = pdev_vec[pdev_idx];
+	vkGetPhysicalDeviceProperties(m_pdev, &m_pdev_props);
+}
+
+
+//the user's cache directory, or the working directory when there is none
+static std::string
+user_cache_path(const char* file_name)
+{
+	if(const char* xdg = getenv("XDG_CACHE_HOME"))
+		return std::string(xdg) + "/" + file_name;
+	if(const char* home = getenv("HOME"))
+		return std::string(home) + "/.cache/" + file_name;
+	return file_name;
+}
+
+//RP_DEVICE_CACHE overrides the location, otherwise it lives next to the pipeline cache
+static std::string
+device_score_path()
+{
+	if(const char* env = getenv("RP_DEVICE_CACHE"))
+		return env;
+	return user_cache_path("raypath.device_scores");
+}
+
+//the pipeline cache uuid changes with the driver as well as the device, so an update means timing it again
+static std::string
+device_key(const VkPhysicalDeviceProperties& props)
+{
+	char key[2 * VK_UUID_SIZE + 32];
+	int len = 0;
+	for(uint32_t i = 0; i < VK_UUID_SIZE; i++)
+		len += snprintf(key + len, sizeof(key) - len, "%02x", props.pipelineCacheUUID[i]);
+	snprintf(key + len, sizeof(key) - len, "-%04x-%04x-%08x", props.vendorID, props.deviceID, props.driverVersion);
+	return key;
+}
+
+//one line per device, its key then its samples per second
+static bool
+read_device_score(const std::string& key, double* score)
+{
+	FILE* file = fopen(device_score_path().c_str(), "r");
+	if(file == nullptr)
+		return false;
+
+	char line_key[128];
+	double line_score;
+	bool found = false;
+	while(!found && fscanf(file, "%127s %lf", line_key, &line_score) == 2)
+	{
+		if(key == line_key)
+		{
+			*score = line_score;
+			found = true;
+		}
+	}
+	fclose(file);
+	return found;
 }
 
+//written to a temporary file first and renamed over the old one, like the pipeline cache
+static void
+write_device_score(const std::string& key, double score)
+{
+	const std::string path = device_score_path();
+	const std::string tmp_path = path + ".tmp" + std::to_string((long)getpid());
+
+	FILE* out = fopen(tmp_path.c_str(), "w");
+	if(out == nullptr)
+	{
+		fprintf(stderr, "WARNING: failed to write device scores %s\n", tmp_path.c_str());
+		return;
+	}
+
+	bool ok = true;
+	if(FILE* in = fopen(path.c_str(), "r"))
+	{
+		char line_key[128];
+		double line_score;
+		while(fscanf(in, "%127s %lf", line_key, &line_score) == 2)
+		{
+			if(key != line_key)
+				ok = fprintf(out, "%s %.0f\n", line_key, line_score) > 0 && ok;
+		}
+		fclose(in);
+	}
+	ok = fprintf(out, "%s %.0f\n", key.c_str(), score) > 0 && ok;
+	ok = fclose(out) == 0 && ok;
+
+	if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		fprintf(stderr, "WARNING: failed to write device scores %s\n", path.c_str());
+		remove(tmp_path.c_str());
+	}
+}
 
 //this function is atrociously bad but it's not a huge deal that it works well
-void 
-Renderer::choose_queue_families()
+//false if the device doesn't have separate compute and transfer queues, benchmark_pdev asks before probing a device
+static bool
+find_queue_families(const std::vector<VkQueueFamilyProperties>& q_props_vec, uint32_t* c_queue_idx, uint32_t* t_queue_idx)
 {
 	//ideally we have 1 compute queue, and 1 transfer queue
 	// -- NVIDIA cards have dedicated transfer queues that are better than the compute & graphics & transfer queue families
-	std::vector<VkQueueFamilyProperties> q_props_vec;
-	
-	uint32_t family_count;
-	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, nullptr);
-	q_props_vec.resize(family_count);
-	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, q_props_vec.data());
+	const uint32_t family_count = (uint32_t)q_props_vec.size();
 
 	std::set<uint32_t> compute_capable;
 	std::set<uint32_t> transfer_capable;
@@ -131,68 +364,103 @@ Renderer::choose_queue_families()
 			transfer_capable.insert(i);
 	}
 
-
-
-
 	if(compute_capable.empty() || transfer_capable.empty())
-	{
-		fprintf(stderr, "could not find required queue families!\n");
-		exit(1);
-	}
+		return false;
 
 
-	bool found_t = false;
 	for(auto t_it : transfer_capable)
 	{
 		//dedicated transfer queue
 		if(compute_capable.find(t_it) == compute_capable.end() && (q_props_vec[t_it].queueFlags & VK_QUEUE_GRAPHICS_BIT) == 0)
 		{
-			m_t_queue_idx = t_it;
-			found_t = true;
-			break;
+			*c_queue_idx = *compute_capable.begin();
+			*t_queue_idx = t_it;
+			return true;
 		}
 	}
 
-	if(!found_t)
+	for(auto c_it : compute_capable)
 	{
-		for(auto c_it : compute_capable)
+		if(q_props_vec[c_it].queueCount > 1 && q_props_vec[c_it].queueFlags & VK_QUEUE_TRANSFER_BIT)
 		{
-			if(q_props_vec[c_it].queueCount > 1 && q_props_vec[c_it].queueFlags & VK_QUEUE_TRANSFER_BIT)
-			{
-				m_c_queue_idx = c_it;
-				m_t_queue_idx = c_it;
-				found_t = true;
-				return;
-			}
+			*c_queue_idx = c_it;
+			*t_queue_idx = c_it;
+			return true;
 		}
 	}
-	
-	m_c_queue_idx = *compute_capable.begin();
-
-
 
-
-	if(!found_t)
+	*c_queue_idx = *compute_capable.begin();
+	for(auto t_it : transfer_capable)
 	{
-		for(auto t_it : transfer_capable)
+		if(t_it != *c_queue_idx)
 		{
-			if(t_it != m_c_queue_idx)
-			{
-				m_t_queue_idx = t_it;
-				found_t = true;
-				break;
-			}
+			*t_queue_idx = t_it;
+			return true;
 		}
-
-		
 	}
 
-	if(!found_t)
+	return false;
+}
+
+//samples per second of the path kernel on a small frame of the job's own scene, 0 if the device can't run it
+//the timing goes through a whole renderer on that device, so it measures exactly what the job will do
+double
+Renderer::benchmark_pdev(VkPhysicalDevice pdev, uint32_t pdev_idx)
+{
+	VkPhysicalDeviceProperties props;
+	vkGetPhysicalDeviceProperties(pdev, &props);
+	//the integrators rank devices differently, so each has its own score
+	const std::string key = device_key(props) + (m_integrator == INTEGRATOR_WAVEFRONT ? "-wavefront" : "-megakernel");
+
+	double score;
+	if(read_device_score(key, &score))
+		return score;
+
+	//the probe would exit the whole process on a device choose_queue_families can't use, like one with a single queue
+	uint32_t family_count;
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &family_count, nullptr);
+	std::vector<VkQueueFamilyProperties> q_props_vec(family_count);
+	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &family_count, q_props_vec.data());
+
+	uint32_t c_queue_idx, t_queue_idx;
+	if(!find_queue_families(q_props_vec, &c_queue_idx, &t_queue_idx))
+		return 0.0;
+
+	Renderer probe(m_render_name, calibration_width, calibration_height, false, m_integrator);
+	probe.set_device(pdev_idx);
+	probe.init();
+
+	//the first frame pays for whatever the driver does lazily
+	probe.render_frame();
+	vkDeviceWaitIdle(probe.m_dev);
+
+	const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for(int i = 0; i < calibration_frames; i++)
+		probe.render_frame();
+	vkDeviceWaitIdle(probe.m_dev);
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	probe.quit();
+
+	score = (double)calibration_width * calibration_height * calibration_frames / seconds;
+	fprintf(stderr, "%s: %.1f Msamples/s\n", props.deviceName, score * 1e-6);
+	write_device_score(key, score);
+	return score;
+}
+
+
+void 
+Renderer::choose_queue_families()
+{
+	uint32_t family_count;
+	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, nullptr);
+	std::vector<VkQueueFamilyProperties> q_props_vec(family_count);
+	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, q_props_vec.data());
+
+	if(!find_queue_families(q_props_vec, &m_c_queue_idx, &m_t_queue_idx))
 	{
 		fprintf(stderr, "failed to find seperate transfer/compute queues!\n");
 		exit(1);
 	}
-
 }
 
 
@@ -203,8 +471,31 @@ Renderer::create_device()
 	size_t queue_family_count = 0;
 	VkDeviceQueueCreateInfo dq_cinfo_array[2];
 
+	//every compute queue the family has, less the one kept for transfers if they share it
+	//independent tiles on separate queues can overlap where one queue would run them back to back
+	//the wavefront path queues are shared by all tiles, so it sticks to one
+	uint32_t family_count;
+	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, nullptr);
+	std::vector<VkQueueFamilyProperties> q_props_vec(family_count);
+	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, q_props_vec.data());
+
+	m_c_queue_count = q_props_vec[m_c_queue_idx].queueCount - (m_t_queue_idx == m_c_queue_idx ? 1 : 0);
+	if(m_c_queue_count > max_compute_queues)
+		m_c_queue_count = max_compute_queues;
+	if(const char* env = getenv("RP_COMPUTE_QUEUES"))
+	{
+		const uint32_t limit = (uint32_t)atoi(env);
+		if(limit >= 1 && limit < m_c_queue_count)
+			m_c_queue_count = limit;
+	}
+	if(m_integrator == INTEGRATOR_WAVEFRONT)
+		m_c_queue_count = 1;
+	m_slot_count = frames_in_flight * m_c_queue_count;
+
 
-	float priorities[] = { 1.0f, 1.0f };
+	float priorities[max_compute_queues + 1];
+	for(float& priority : priorities)
+		priority = 1.0f;
 	if(m_t_queue_idx == m_c_queue_idx)
 	{
 		VkDeviceQueueCreateInfo& dq_cinfo = dq_cinfo_array[0];
@@ -212,7 +503,7 @@ Renderer::create_device()
 		dq_cinfo.pNext = nullptr;
 		dq_cinfo.flags = 0;
 		dq_cinfo.queueFamilyIndex = m_c_queue_idx;
-		dq_cinfo.queueCount = 2;
+		dq_cinfo.queueCount = m_c_queue_count + 1;
 		dq_cinfo.pQueuePriorities = priorities;
 
 		queue_family_count = 1;
@@ -224,7 +515,7 @@ Renderer::create_device()
 		c_dq_cinfo.pNext = nullptr;
 		c_dq_cinfo.flags = 0;
 		c_dq_cinfo.queueFamilyIndex = m_c_queue_idx;
-		c_dq_cinfo.queueCount = 1;
+		c_dq_cinfo.queueCount = m_c_queue_count;
 		c_dq_cinfo.pQueuePriorities = priorities;
 
 
@@ -248,22 +539,40 @@ Renderer::create_device()
 	dev_cinfo.pQueueCreateInfos = dq_cinfo_array;
 	dev_cinfo.enabledLayerCount = 0;
 	dev_cinfo.ppEnabledLayerNames = nullptr;
-#ifndef USING_MOLTEN_VK
-	dev_cinfo.enabledExtensionCount = 0;
-	dev_cinfo.ppEnabledExtensionNames = nullptr;
-#else 
-	const char* ext[] = { "VK_KHR_portability_subset"};
-	dev_cinfo.enabledExtensionCount = 1;
-	dev_cinfo.ppEnabledExtensionNames = ext;
+
+	std::vector<const char*> ext_vec;
+#ifdef USING_MOLTEN_VK
+	ext_vec.push_back("VK_KHR_portability_subset");
 #endif
+
+	//lets vma report what the driver actually has left for us instead of guessing from the heap sizes,
+	//which matters when several renders share one gpu
+	uint32_t ext_count = 0;
+	vkEnumerateDeviceExtensionProperties(m_pdev, nullptr, &ext_count, nullptr);
+	std::vector<VkExtensionProperties> ext_props_vec(ext_count);
+	vkEnumerateDeviceExtensionProperties(m_pdev, nullptr, &ext_count, ext_props_vec.data());
+	for(const VkExtensionProperties& props : ext_props_vec)
+	{
+		if(strcmp(props.extensionName, "VK_EXT_memory_budget") == 0)
+		{
+			ext_vec.push_back("VK_EXT_memory_budget");
+			m_has_memory_budget = true;
+		}
+	}
+	if(!m_has_memory_budget)
+		fprintf(stderr, "WARNING: VK_EXT_memory_budget not supported, memory budget is estimated from heap sizes\n");
+
+	dev_cinfo.enabledExtensionCount = (uint32_t)ext_vec.size();
+	dev_cinfo.ppEnabledExtensionNames = ext_vec.empty() ? nullptr : ext_vec.data();
 	dev_cinfo.pEnabledFeatures = nullptr;
 
 	CHECKVK(vkCreateDevice(m_pdev, &dev_cinfo, nullptr, &m_dev), 
 		"failed to create logical device!");
 
-	vkGetDeviceQueue(m_dev, m_c_queue_idx, 0, &m_c_queue);
+	for(uint32_t i = 0; i < m_c_queue_count; i++)
+		vkGetDeviceQueue(m_dev, m_c_queue_idx, i, &m_c_queue_array[i]);
 	if(m_c_queue_idx == m_t_queue_idx)
-		vkGetDeviceQueue(m_dev, m_c_queue_idx, 1, &m_t_queue);
+		vkGetDeviceQueue(m_dev, m_c_queue_idx, m_c_queue_count, &m_t_queue);
 	else
 		vkGetDeviceQueue(m_dev, m_t_queue_idx, 0, &m_t_queue);
 
@@ -277,10 +586,21 @@ Renderer::create_allocator()
 	allocatorInfo.physicalDevice = m_pdev;
 	allocatorInfo.device = m_dev;
 	allocatorInfo.instance = m_instance;
+	if(m_has_memory_budget)
+		allocatorInfo.flags |= VMA_ALLOCATOR_CREATE_EXT_MEMORY_BUDGET_BIT;
 
 	CHECKVK(vmaCreateAllocator(&allocatorInfo, &m_vma), 
 		"failed to create VMA allocator!");
 
+	//the scene is the one pool that can grow, how big it gets depends on the scene
+	m_direct_upload = has_direct_upload_memory();
+	if(!create_pool(POOL_SCENE, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, 0, 0, 
+		m_direct_upload ? VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT : 0))
+	{
+		fprintf(stderr, "WARNING: failed to create scene memory pool\n");
+		m_direct_upload = false;
+	}
+
 
 }
 
@@ -294,8 +614,12 @@ Renderer::create_command_pools()
 	pool_cinfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 	pool_cinfo.queueFamilyIndex = m_c_queue_idx;
 
-	CHECKVK(vkCreateCommandPool(m_dev, &pool_cinfo, nullptr, &m_c_cmd_pool), 
-		"failed to create compute command pool!");
+	//one per compute queue, so recording for one never has to synchronize with another
+	for(uint32_t i = 0; i < m_c_queue_count; i++)
+	{
+		CHECKVK(vkCreateCommandPool(m_dev, &pool_cinfo, nullptr, &m_c_cmd_pool_array[i]), 
+			"failed to create compute command pool!");
+	}
 
 	pool_cinfo.flags = 0;
 	pool_cinfo.queueFamilyIndex = m_t_queue_idx;
@@ -311,16 +635,17 @@ Renderer::create_command_buffers()
 	VkCommandBufferAllocateInfo alloc_info;
 	alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	alloc_info.pNext = nullptr;
-	alloc_info.commandPool = m_c_cmd_pool;
 	alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	alloc_info.commandBufferCount = 2;
-
+	alloc_info.commandBufferCount = 1;
 
-	CHECKVK(vkAllocateCommandBuffers(m_dev, &alloc_info, m_c_cmd_buf_array),
-		"failed to allocate compute command buffers!");
+	for(uint32_t i = 0; i < m_slot_count; i++)
+	{
+		alloc_info.commandPool = m_c_cmd_pool_array[i % m_c_queue_count];
+		CHECKVK(vkAllocateCommandBuffers(m_dev, &alloc_info, &m_c_cmd_buf_array[i]),
+			"failed to allocate compute command buffers!");
+	}
 	
 	alloc_info.commandPool = m_t_cmd_pool;
-	alloc_info.commandBufferCount = 1;
 
 	CHECKVK(vkAllocateCommandBuffers(m_dev, &alloc_info, &m_t_cmd_buf),
 		"failed to allocate transfer command buffer!");
@@ -328,6 +653,114 @@ Renderer::create_command_buffers()
 }
 
 
+//kernels come from the spir-v linked into the binary
+//setting RP_KERNEL_DIR loads <dir>/<name>.spv from disk instead, so kernels can be iterated on without relinking
+VkShaderModule
+Renderer::create_shader_module(const char* name)
+{
+	const uint32_t* code = nullptr;
+	size_t code_size = 0;
+	void* disk_code = nullptr;
+
+	if(const char* kernel_dir = getenv("RP_KERNEL_DIR"))
+	{
+		const std::string path = std::string(kernel_dir) + "/" + name + ".spv";
+		disk_code = read_binary(path.c_str(), &code_size);
+		if(disk_code == nullptr)
+		{
+			fprintf(stderr, "failed to read shader binary %s from disk!\n", path.c_str());
+			exit(1);
+		}
+		code = (const uint32_t*)disk_code; //glslangValidator produces 4 byte aligned binaries, and calloc'd memory is aligned for anything
+	}
+	else
+	{
+		const ShaderBinary* shader = find_shader(name);
+		if(shader == nullptr)
+		{
+			fprintf(stderr, "no embedded shader named %s!\n", name);
+			exit(1);
+		}
+		code = shader->code;
+		code_size = shader->size;
+	}
+
+	VkShaderModuleCreateInfo shader_module_cinfo;
+	shader_module_cinfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	shader_module_cinfo.pNext = nullptr;
+	shader_module_cinfo.flags = 0;
+	shader_module_cinfo.codeSize = code_size;
+	shader_module_cinfo.pCode = code;
+
+	VkShaderModule shader_module;
+	CHECKVK(vkCreateShaderModule(m_dev, &shader_module_cinfo, nullptr, &shader_module),
+		"failed to create shader module!");
+
+	free(disk_code);
+	return shader_module;
+}
+
+
+//picks the kernel specializations for this device and scene
+void
+Renderer::choose_kernel_variant()
+{
+	const VkPhysicalDeviceLimits& limits = m_pdev_props.limits;
+
+	//subgroup size is only queryable when both the instance and the device are 1.1, 32 is the most common width otherwise
+	uint32_t subgroup_size = 32;
+	if(m_instance_api_version >= VK_API_VERSION_1_1 && m_pdev_props.apiVersion >= VK_API_VERSION_1_1 &&
+		vkGetPhysicalDeviceProperties2KHR != nullptr)
+	{
+		VkPhysicalDeviceSubgroupProperties subgroup_props;
+		subgroup_props.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+		subgroup_props.pNext = nullptr;
+
+		VkPhysicalDeviceProperties2KHR props2;
+		props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		props2.pNext = &subgroup_props;
+
+		vkGetPhysicalDeviceProperties2KHR(m_pdev, &props2);
+		if(subgroup_props.subgroupSize != 0)
+			subgroup_size = subgroup_props.subgroupSize;
+	}
+
+	//one subgroup per workgroup keeps divergent paths from holding other warps hostage,
+	//but tiny subgroups are doubled up until the group covers at least a 4x4 tile
+	uint32_t invocations = subgroup_size;
+	while(invocations < 16)
+		invocations *= 2;
+	if(invocations > limits.maxComputeWorkGroupInvocations)
+		invocations = limits.maxComputeWorkGroupInvocations;
+
+	//as square as possible, wider than tall
+	uint32_t size_x = 1;
+	while(size_x * size_x < invocations)
+		size_x *= 2;
+	if(size_x > limits.maxComputeWorkGroupSize[0])
+		size_x = limits.maxComputeWorkGroupSize[0];
+
+	uint32_t size_y = invocations / size_x;
+	if(size_y == 0)
+		size_y = 1;
+	if(size_y > limits.maxComputeWorkGroupSize[1])
+		size_y = limits.maxComputeWorkGroupSize[1];
+
+	m_kernel_variant.local_size_x = size_x;
+	m_kernel_variant.local_size_y = size_y;
+	m_kernel_variant.max_bounces = m_scene.max_bounces;
+	m_kernel_variant.use_metal = scene_uses_material(m_scene, MATERIAL_METAL) ? VK_TRUE : VK_FALSE;
+	m_kernel_variant.use_dielectric = scene_uses_material(m_scene, MATERIAL_DIELECTRIC) ? VK_TRUE : VK_FALSE;
+
+	//the wavefront kernels index a flat queue, same invocation count in one row
+	m_wf_variant = m_kernel_variant;
+	m_wf_variant.local_size_x = size_x * size_y;
+	if(m_wf_variant.local_size_x > limits.maxComputeWorkGroupSize[0])
+		m_wf_variant.local_size_x = limits.maxComputeWorkGroupSize[0];
+	m_wf_variant.local_size_y = 1;
+}
+
+
 void 
 Renderer::create_pipeline()
 {
@@ -335,7 +768,7 @@ Renderer::create_pipeline()
 	VkDescriptorPoolSize pool_size_array[pool_size_array_size];
 
 	pool_size_array[0].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	pool_size_array[0].descriptorCount = 4;
+	pool_size_array[0].descriptorCount = 11;
 
 	pool_size_array[1].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	pool_size_array[1].descriptorCount = 2;
@@ -356,26 +789,19 @@ Renderer::create_pipeline()
 
 
 
-	const size_t binding_array_size = 3;
+	//0 params, 1 spheres, 2 accumulation, 3 stats, 10 bvh nodes, 11 sphere centers and radii, shared by every kernel
+	//4 paths, 5 ray queue, 6 hits, 7 shadow queue, 8 lights, 9 queue counts, only used and written by the wavefront integrator
+	const size_t binding_array_size = 12;
 	VkDescriptorSetLayoutBinding binding_array[binding_array_size];
-	
-	binding_array[0].binding = 0;
-	binding_array[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	binding_array[0].descriptorCount = 1;
-	binding_array[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-	binding_array[0].pImmutableSamplers = nullptr;
-
-	binding_array[1].binding = 1;
-	binding_array[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	binding_array[1].descriptorCount = 1;
-	binding_array[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-	binding_array[1].pImmutableSamplers = nullptr;
-
-	binding_array[2].binding = 2;
-	binding_array[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	binding_array[2].descriptorCount = 1;
-	binding_array[2].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
-	binding_array[2].pImmutableSamplers = nullptr;
+
+	for(uint32_t b = 0; b < binding_array_size; b++)
+	{
+		binding_array[b].binding = b;
+		binding_array[b].descriptorType = b == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		binding_array[b].descriptorCount = 1;
+		binding_array[b].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+		binding_array[b].pImmutableSamplers = nullptr;
+	}
 
 	VkDescriptorSetLayoutCreateInfo dset_layout_cinfo;
 	dset_layout_cinfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -397,31 +823,32 @@ Renderer::create_pipeline()
 	layout_cinfo.flags = 0;
 	layout_cinfo.setLayoutCount = 1;
 	layout_cinfo.pSetLayouts = &m_dset_layout;
-	layout_cinfo.pushConstantRangeCount = 0;
-	layout_cinfo.pPushConstantRanges = nullptr;
+	VkPushConstantRange push_range;
+	push_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+	push_range.offset = 0;
+	push_range.size = sizeof(PushConstants); //104 bytes, within the guaranteed 128
+
+	layout_cinfo.pushConstantRangeCount = 1;
+	layout_cinfo.pPushConstantRanges = &push_range;
 
 	CHECKVK(vkCreatePipelineLayout(m_dev, &layout_cinfo, nullptr, &m_pipeline_layout),
 		"failed to create pipeline layout");
 
 
-	size_t shader_code_size;
-	void* shader_code = read_binary("path.comp.spv", &shader_code_size);
-	if(shader_code == nullptr)
+	if(m_integrator == INTEGRATOR_WAVEFRONT)
 	{
-		fprintf(stderr, "failed to read shader binary from disk!\n");
-		exit(1);
+		for(uint32_t i = 0; i < WF_STAGE_COUNT; i++)
+			m_wf_pipeline_array[i] = create_compute_pipeline(wavefront_kernel_name_array[i], m_wf_variant);
 	}
+	else
+		m_compute_pipeline = create_compute_pipeline("path.comp", m_kernel_variant);
+}
 
-	VkShaderModuleCreateInfo shader_module_cinfo;
-	shader_module_cinfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	shader_module_cinfo.pNext = nullptr;
-	shader_module_cinfo.flags = 0;
-	shader_module_cinfo.codeSize = shader_code_size;
-	shader_module_cinfo.pCode = (uint32_t*)shader_code; //glslangValidator produces 4 byte aligned binaries, and the binary reader will read exactly that, so no problem
 
-	VkShaderModule shader_module;
-	CHECKVK(vkCreateShaderModule(m_dev, &shader_module_cinfo, nullptr, &shader_module),
-		"failed to create shader module!");
+VkPipeline
+Renderer::create_compute_pipeline(const char* name, const KernelVariant& variant)
+{
+	VkShaderModule shader_module = create_shader_module(name);
 
 
 	VkPipelineShaderStageCreateInfo shader_stage_cinfo;
@@ -431,7 +858,25 @@ Renderer::create_pipeline()
 	shader_stage_cinfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
 	shader_stage_cinfo.module = shader_module;
 	shader_stage_cinfo.pName = "main";
-	shader_stage_cinfo.pSpecializationInfo = nullptr;
+
+
+	const size_t spec_entry_count = 5;
+	VkSpecializationMapEntry spec_entry_array[spec_entry_count];
+	for(uint32_t i = 0; i < spec_entry_count; i++)
+	{
+		//every member of KernelVariant is 4 bytes, laid out in constant_id order
+		spec_entry_array[i].constantID = i;
+		spec_entry_array[i].offset = i * sizeof(uint32_t);
+		spec_entry_array[i].size = sizeof(uint32_t);
+	}
+
+	VkSpecializationInfo spec_info;
+	spec_info.mapEntryCount = spec_entry_count;
+	spec_info.pMapEntries = spec_entry_array;
+	spec_info.dataSize = sizeof(KernelVariant);
+	spec_info.pData = &variant;
+
+	shader_stage_cinfo.pSpecializationInfo = &spec_info;
 
 
 
@@ -444,136 +889,1904 @@ Renderer::create_pipeline()
 	pipe_cinfo.basePipelineHandle = VK_NULL_HANDLE;
 	pipe_cinfo.basePipelineIndex = 0;
 
-	CHECKVK(vkCreateComputePipelines(m_dev, VK_NULL_HANDLE, 1, &pipe_cinfo, nullptr, &m_compute_pipeline),
+	VkPipeline pipeline;
+	CHECKVK(vkCreateComputePipelines(m_dev, m_pipeline_cache, 1, &pipe_cinfo, nullptr, &pipeline),
 		"failed to create compute pipeline!");
 
+	vkDestroyShaderModule(m_dev, shader_module, nullptr);
+	return pipeline;
 }
 
 
 void
-Renderer::init()
+Renderer::create_frame_resources()
 {
-	create_instance();
-	choose_pdev();
-	choose_queue_families();
-	create_device();
-	create_allocator();
-	create_command_pools();
-	create_command_buffers();
-	create_pipeline();
-}
+	VkFenceCreateInfo fence_cinfo;
+	fence_cinfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fence_cinfo.pNext = nullptr;
+	fence_cinfo.flags = VK_FENCE_CREATE_SIGNALED_BIT; //so the first wait on every fence falls straight through
 
+	CHECKVK(vkCreateFence(m_dev, &fence_cinfo, nullptr, &m_t_fence),
+		"failed to create transfer fence!");
 
+	VkSemaphoreCreateInfo sem_cinfo;
+	sem_cinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	sem_cinfo.pNext = nullptr;
+	sem_cinfo.flags = 0;
 
-void
-Renderer::quit()
-{
+	for(uint32_t i = 0; i < m_c_queue_count; i++)
+	{
+		CHECKVK(vkCreateSemaphore(m_dev, &sem_cinfo, nullptr, &m_t_semaphore_array[i]),
+			"failed to create transfer semaphore!");
+		CHECKVK(vkCreateSemaphore(m_dev, &sem_cinfo, nullptr, &m_c_semaphore_array[i]),
+			"failed to create compute semaphore!");
+	}
+
+	for(uint32_t i = 0; i < m_slot_count; i++)
+	{
+		CHECKVK(vkCreateFence(m_dev, &fence_cinfo, nullptr, &m_c_fence_array[i]),
+			"failed to create frame fence!");
+	}
 
+	//only holds what is fixed for the whole job, per pass values are push constants
+	if(!create_buffer(&m_params_buf, sizeof(RenderParams), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU))
+	{
+		fprintf(stderr, "failed to create render parameter buffer!\n");
+		exit(1);
+	}
 
-	vkDestroyCommandPool(m_dev, m_t_cmd_pool, nullptr);
-	vkDestroyCommandPool(m_dev, m_c_cmd_pool, nullptr);
-	vmaDestroyAllocator(m_vma);
-	vkDestroyDevice(m_dev, nullptr);
-	vkDestroyInstance(m_instance, nullptr);
-	//no cleanup for volk
+	RenderParams* params = (RenderParams*)m_params_buf.mapped;
+	params->width = m_width;
+	params->height = m_height;
+	params->sphere_count = (uint32_t)m_scene.sphere_vec.size();
+	std::vector<uint32_t> light_vec;
+	scene_lights(m_scene, &light_vec);
+	params->light_count = (uint32_t)light_vec.size();
+	params->path_capacity = 0; //set once the path queues exist
+	params->pad[0] = 0;
+	params->pad[1] = 0;
+	params->pad[2] = 0;
+	vmaFlushAllocation(m_vma, m_params_buf.alloc, 0, VK_WHOLE_SIZE);
+
+	//rgb radiance sum + sample count per pixel
+	//the one buffer that can't shrink, so it is allowed past the budget and vma may place it in host memory if it has to
+	const size_t accum_size = (size_t)m_width * (size_t)m_height * 4 * sizeof(float);
+	if(accum_size > device_memory_available())
+		fprintf(stderr, "WARNING: accumulation buffer of %u MB exceeds the device memory budget\n", (uint32_t)(accum_size >> 20));
+	if(!create_buffer(&m_accum_buf, accum_size))
+	{
+		fprintf(stderr, "failed to create accumulation buffer!\n");
+		exit(1);
+	}
+
+
+	//nothing bound changes between passes, so both frame slots share one set
+	VkDescriptorSetAllocateInfo dset_ainfo;
+	dset_ainfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	dset_ainfo.pNext = nullptr;
+	dset_ainfo.descriptorPool = m_descriptor_pool;
+	dset_ainfo.descriptorSetCount = 1;
+	dset_ainfo.pSetLayouts = &m_dset_layout;
+
+	CHECKVK(vkAllocateDescriptorSets(m_dev, &dset_ainfo, &m_dset),
+		"failed to allocate descriptor set!");
 }
 
 
 void
-Renderer::render_frame()
+Renderer::upload_scene()
 {
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	const size_t scene_size = m_scene.sphere_vec.size() * sizeof(Sphere);
+	//mapped when the scene pool is in host visible device local memory, add_upload then writes it directly
+	//concurrent, written by the transfer queue and read by the compute queues without ownership transfers, see record_uploads
+	const VmaAllocationCreateFlags alloc_flags = m_direct_upload ? VMA_ALLOCATION_CREATE_MAPPED_BIT : 0;
+	if(!create_buffer(&m_scene_buf, scene_size, usage, VMA_MEMORY_USAGE_GPU_ONLY, true, alloc_flags, POOL_SCENE))
+	{
+		fprintf(stderr, "failed to create scene buffer!\n");
+		exit(1);
+	}
 
-}
-
+	const size_t bvh_size = m_bvh_node_vec.size() * sizeof(BvhNode);
+	if(!create_buffer(&m_bvh_buf, bvh_size, usage, VMA_MEMORY_USAGE_GPU_ONLY, true, alloc_flags, POOL_SCENE))
+	{
+		fprintf(stderr, "failed to create bvh buffer!\n");
+		exit(1);
+	}
 
+	//what traversal reads of the spheres, packed apart from the materials so leaves full of small spheres stay cheap to test
+	std::vector<float> geom_vec(m_scene.sphere_vec.size() * 4);
+	for(size_t i = 0; i < m_scene.sphere_vec.size(); i++)
+	{
+		const Sphere& s = m_scene.sphere_vec[i];
+		geom_vec[i * 4 + 0] = s.center[0];
+		geom_vec[i * 4 + 1] = s.center[1];
+		geom_vec[i * 4 + 2] = s.center[2];
+		geom_vec[i * 4 + 3] = s.radius;
+	}
 
+	const size_t geom_size = geom_vec.size() * sizeof(float);
+	if(!create_buffer(&m_sphere_geom_buf, geom_size, usage, VMA_MEMORY_USAGE_GPU_ONLY, true, alloc_flags, POOL_SCENE))
+	{
+		fprintf(stderr, "failed to create sphere geometry buffer!\n");
+		exit(1);
+	}
 
-bool 
-Renderer::create_buffer(Buffer* buf, const size_t size)
-{
-	VkBufferCreateInfo buf_cinfo;
-	buf_cinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	buf_cinfo.pNext = nullptr;
-	buf_cinfo.flags = 0; 
-	buf_cinfo.size = size;
-	buf_cinfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT; 
-	buf_cinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	buf_cinfo.queueFamilyIndexCount = 0;
-	buf_cinfo.pQueueFamilyIndices = nullptr;
+	add_upload(&m_scene_buf, m_scene.sphere_vec.data(), scene_size);
+	add_upload(&m_bvh_buf, m_bvh_node_vec.data(), bvh_size);
+	add_upload(&m_sphere_geom_buf, geom_vec.data(), geom_size);
 
-	VmaAllocationCreateInfo ainfo = {};
-	ainfo.usage = VMA_MEMORY_USAGE_GPU_ONLY;
+	//outlives the batch, which only reads it when submitted
+	std::vector<uint32_t> light_vec;
+	if(m_integrator == INTEGRATOR_WAVEFRONT)
+	{
+		//never empty, a zero sized buffer can't be bound even if no light is ever sampled
+		scene_lights(m_scene, &light_vec);
+		if(light_vec.empty())
+			light_vec.push_back(0);
 
-	buf->size = size;
+		const size_t light_size = light_vec.size() * sizeof(uint32_t);
+		if(!create_buffer(&m_light_buf, light_size, usage, VMA_MEMORY_USAGE_GPU_ONLY, true, alloc_flags, POOL_SCENE))
+		{
+			fprintf(stderr, "failed to create light buffer!\n");
+			exit(1);
+		}
+		add_upload(&m_light_buf, light_vec.data(), light_size);
+	}
 
-	return vmaCreateBuffer(m_vma, &buf_cinfo, &ainfo, &buf->handle, &buf->alloc, nullptr) == VK_SUCCESS;
+	if(!submit_uploads())
+	{
+		fprintf(stderr, "failed to upload scene!\n");
+		exit(1);
+	}
 }
 
-void 
-Renderer::destroy_buffer(Buffer* buf)
+
+//the path state and queues only ever live on the gpu, written by one stage and read by the next
+void
+Renderer::create_wavefront_resources()
 {
-	vmaDestroyBuffer(m_vma, buf->handle, buf->alloc);
+	//the queues are most of the wavefront's memory, so they're sized from what the budget has left
+	//and halved until they fit, a smaller capacity only means smaller tiles
+	const VkDeviceSize available = device_memory_available();
+	uint32_t capacity = wavefront_path_capacity;
+	while(capacity > min_wavefront_path_capacity && capacity * path_queue_bytes > available * path_queue_budget_share)
+		capacity /= 2;
+
+	while(!create_path_queues(capacity))
+	{
+		if(capacity <= min_wavefront_path_capacity)
+		{
+			fprintf(stderr, "failed to create wavefront buffers!\n");
+			exit(1);
+		}
+		capacity /= 2;
+	}
+
+	if(capacity < wavefront_path_capacity)
+		fprintf(stderr, "WARNING: %u MB of device memory available, wavefront tiles limited to %u paths\n", 
+			(uint32_t)(available >> 20), capacity);
+}
+
+//the queues and counts get a linear pool of their own, with one block sized to fit them exactly,
+//so resizing them frees the whole block instead of leaving holes between longer lived buffers
+//only the smallest capacity is allowed past the budget, a gpu that is too full even for that is left to the driver
+bool
+Renderer::create_path_queues(uint32_t capacity)
+{
+	const VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT;
+	const VmaAllocationCreateFlags flags = capacity > min_wavefront_path_capacity ? VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT : 0;
+	const VkDeviceSize block_size = capacity * path_queue_bytes + 2 * queue_counts_size + 5 * frame_pool_alignment_slack;
+	if(!create_pool(POOL_FRAME, usage, VMA_MEMORY_USAGE_GPU_ONLY, VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT, block_size))
+		fprintf(stderr, "WARNING: failed to create frame memory pool\n");
+
+	const size_t queue_count = 5;
+	Buffer* const buf_array[queue_count] = { &m_path_buf, &m_ray_queue_buf, &m_hit_buf, &m_shadow_queue_buf, &m_count_buf };
+	const size_t size_array[queue_count] = {
+		capacity * path_state_size,
+		2 * capacity * ray_size,
+		capacity * hit_size,
+		2 * capacity * shadow_ray_size,
+		2 * queue_counts_size,
+	};
+
+	//a failed attempt only gives back what it created itself
+	for(size_t i = 0; i < queue_count; i++)
+	{
+		if(!create_buffer(buf_array[i], size_array[i], usage, VMA_MEMORY_USAGE_GPU_ONLY, false, flags, POOL_FRAME))
+		{
+			for(size_t j = 0; j < i; j++)
+				destroy_buffer(buf_array[j]);
+			destroy_pool(POOL_FRAME);
+			m_wf_path_capacity = 0;
+			return false;
+		}
+	}
+
+	m_wf_path_capacity = capacity;
+	RenderParams* params = (RenderParams*)m_params_buf.mapped;
+	params->path_capacity = capacity;
+	vmaFlushAllocation(m_vma, m_params_buf.alloc, 0, VK_WHOLE_SIZE);
+	return true;
+}
+
+void
+Renderer::destroy_path_queues()
+{
+	destroy_buffer(&m_path_buf);
+	destroy_buffer(&m_ray_queue_buf);
+	destroy_buffer(&m_hit_buf);
+	destroy_buffer(&m_shadow_queue_buf);
+	destroy_buffer(&m_count_buf);
+	destroy_pool(POOL_FRAME);
+	m_wf_path_capacity = 0;
+}
+
+
+void
+Renderer::write_descriptor_sets()
+{
+	//in binding order, see create_pipeline, the wavefront buffers are null for the megakernel and left unwritten
+	const size_t max_binding_count = 12;
+	const VkBuffer buf_array[max_binding_count] = {
+		m_params_buf.handle,
+		m_scene_buf.handle,
+		m_accum_buf.handle,
+		m_stats_buf.handle,
+		m_path_buf.handle,
+		m_ray_queue_buf.handle,
+		m_hit_buf.handle,
+		m_shadow_queue_buf.handle,
+		m_light_buf.handle,
+		m_count_buf.handle,
+		m_bvh_buf.handle,
+		m_sphere_geom_buf.handle,
+	};
+
+	VkDescriptorBufferInfo buf_info_array[max_binding_count];
+	VkWriteDescriptorSet write_array[max_binding_count];
+	uint32_t write_count = 0;
+	for(uint32_t b = 0; b < max_binding_count; b++)
+	{
+		if(buf_array[b] == VK_NULL_HANDLE)
+			continue;
+
+		VkDescriptorBufferInfo& buf_info = buf_info_array[write_count];
+		buf_info.buffer = buf_array[b];
+		buf_info.offset = 0;
+		buf_info.range = VK_WHOLE_SIZE;
+
+		VkWriteDescriptorSet& write = write_array[write_count];
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.pNext = nullptr;
+		write.dstSet = m_dset;
+		write.dstBinding = b;
+		write.dstArrayElement = 0;
+		write.descriptorCount = 1;
+		write.descriptorType = b == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+		write.pImageInfo = nullptr;
+		write.pBufferInfo = &buf_info;
+		write.pTexelBufferView = nullptr;
+		write_count++;
+	}
+
+	vkUpdateDescriptorSets(m_dev, write_count, write_array, 0, nullptr);
+}
+
+
+//our own header in front of the driver's cache blob
+//vulkan's header carries the uuid and vendor but not the driver version, and nothing to catch a truncated file
+struct PipelineCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t vendor_id;
+	uint32_t device_id;
+	uint32_t driver_version;
+	uint8_t uuid[VK_UUID_SIZE];
+	uint32_t reserved; //keeps the 64 bit fields aligned without padding bytes
+	uint64_t data_size;
+	uint64_t data_hash;
+};
+
+static const char pipeline_cache_magic[4] = { 'R', 'P', 'P', 'C' };
+static const uint32_t pipeline_cache_version = 1;
+
+static uint64_t
+fnv1a(const void* data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for(size_t i = 0; i < size; i++)
+	{
+		hash ^= ((const uint8_t*)data)[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+//lives in the user's cache directory, one file per device named after its device_key,
+//so the renderers of a multi device job don't overwrite each other's
+//RP_PIPELINE_CACHE is the exact file for a renderer that picks its own device, as it always was,
+//renderers pinned by set_device, one per device of a MultiRenderer, append their device_key to it
+static std::string
+pipeline_cache_path(const VkPhysicalDeviceProperties& props, bool pinned)
+{
+	std::string path;
+	if(const char* env = getenv("RP_PIPELINE_CACHE"))
+	{
+		if(!pinned)
+			return env;
+		path = env;
+	}
+	else
+		path = user_cache_path("raypath.pipeline_cache");
+	return path + "." + device_key(props);
+}
+
+void
+Renderer::create_pipeline_cache()
+{
+	const bool pinned = m_pinned_pdev_idx >= 0;
+	const std::string path = pipeline_cache_path(m_pdev_props, pinned);
+	if(pinned && getenv("RP_PIPELINE_CACHE") != nullptr)
+		fprintf(stderr, "WARNING: RP_PIPELINE_CACHE is one file per device here, using %s\n", path.c_str());
+
+	size_t file_size = 0;
+	void* file_data = read_binary(path.c_str(), &file_size);
+
+	const void* initial_data = nullptr;
+	size_t initial_size = 0;
+
+	if(file_data != nullptr && file_size >= sizeof(PipelineCacheHeader))
+	{
+		PipelineCacheHeader header;
+		memcpy(&header, file_data, sizeof(header));
+		const void* blob = (const char*)file_data + sizeof(header);
+
+		//any mismatch means a different gpu or driver wrote this, so the blob would be rejected or worse
+		if(memcmp(header.magic, pipeline_cache_magic, sizeof(header.magic)) == 0 &&
+			header.version == pipeline_cache_version &&
+			header.vendor_id == m_pdev_props.vendorID &&
+			header.device_id == m_pdev_props.deviceID &&
+			header.driver_version == m_pdev_props.driverVersion &&
+			memcmp(header.uuid, m_pdev_props.pipelineCacheUUID, VK_UUID_SIZE) == 0 &&
+			header.data_size == file_size - sizeof(header) &&
+			header.data_hash == fnv1a(blob, header.data_size))
+		{
+			initial_data = blob;
+			initial_size = header.data_size;
+		}
+		else
+			fprintf(stderr, "WARNING: ignoring stale pipeline cache %s\n", path.c_str());
+	}
+
+	VkPipelineCacheCreateInfo cache_cinfo;
+	cache_cinfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+	cache_cinfo.pNext = nullptr;
+	cache_cinfo.flags = 0;
+	cache_cinfo.initialDataSize = initial_size;
+	cache_cinfo.pInitialData = initial_data;
+
+	CHECKVK(vkCreatePipelineCache(m_dev, &cache_cinfo, nullptr, &m_pipeline_cache),
+		"failed to create pipeline cache!");
+
+	free(file_data);
+}
+
+//written to a temporary file first and renamed over the old one, so a crash or a concurrent render never sees half a cache
+void
+Renderer::save_pipeline_cache()
+{
+	size_t data_size = 0;
+	if(vkGetPipelineCacheData(m_dev, m_pipeline_cache, &data_size, nullptr) != VK_SUCCESS || data_size == 0)
+		return;
+
+	std::vector<uint8_t> data(data_size);
+	if(vkGetPipelineCacheData(m_dev, m_pipeline_cache, &data_size, data.data()) != VK_SUCCESS)
+		return;
+
+	PipelineCacheHeader header;
+	memcpy(header.magic, pipeline_cache_magic, sizeof(header.magic));
+	header.version = pipeline_cache_version;
+	header.vendor_id = m_pdev_props.vendorID;
+	header.device_id = m_pdev_props.deviceID;
+	header.driver_version = m_pdev_props.driverVersion;
+	memcpy(header.uuid, m_pdev_props.pipelineCacheUUID, VK_UUID_SIZE);
+	header.reserved = 0;
+	header.data_size = data_size;
+	header.data_hash = fnv1a(data.data(), data_size);
+
+	const std::string path = pipeline_cache_path(m_pdev_props, m_pinned_pdev_idx >= 0);
+	const std::string tmp_path = path + ".tmp" + std::to_string((long)getpid());
+
+	FILE* file = fopen(tmp_path.c_str(), "wb");
+	if(file == nullptr)
+	{
+		fprintf(stderr, "WARNING: failed to write pipeline cache %s\n", tmp_path.c_str());
+		return;
+	}
+
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data.data(), data_size, 1, file) == 1;
+	ok = fclose(file) == 0 && ok;
+
+	if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0)
+	{
+		fprintf(stderr, "WARNING: failed to write pipeline cache %s\n", path.c_str());
+		remove(tmp_path.c_str());
+	}
+}
+
+
+void
+Renderer::init()
+{
+	create_instance();
+	choose_pdev();
+	choose_queue_families();
+	create_device();
+	create_allocator();
+	create_command_pools();
+	create_command_buffers();
+	create_pipeline_cache();
+
+	//the pipeline is specialized for the scene, so it has to be known first
+	//the bvh reorders the spheres, so it has to be built before anything indexes them
+	if(!load_scene(m_render_name, &m_scene) || !build_bvh(&m_scene.sphere_vec, &m_bvh_node_vec))
+		exit(1);
+	make_camera_frame(m_scene.camera, m_width, m_height, &m_camera_frame);
+	choose_kernel_variant();
+	create_pipeline();
+
+	m_tile_budget_ms = default_tile_budget_ms;
+	if(const char* budget = getenv("RP_TILE_BUDGET_MS"))
+		set_tile_budget(atof(budget));
+
+	create_frame_resources();
+	if(m_integrator == INTEGRATOR_WAVEFRONT)
+		create_wavefront_resources();
+	create_profiler();
+	create_staging_ring();
+	upload_scene();
+	write_descriptor_sets();
+}
+
+
+
+void
+Renderer::quit()
+{
+	if(m_writer_thread.joinable())
+		m_writer_thread.join();
+
+	//everything below may still be referenced by in flight sample passes
+	vkDeviceWaitIdle(m_dev);
+	destroy_readback_resources();
+	retire_transfers(true);
+	for(uint32_t i = 0; i < m_slot_count; i++)
+		collect_pass_stats((m_frame_idx + i) % m_slot_count); //oldest pass first
+
+	//what each pool looks like at the end of a long session is where fragmentation shows
+	for(uint32_t i = POOL_SCENE; i < POOL_COUNT && m_profile_log != nullptr; i++)
+	{
+		const PoolStats stats = pool_stats((MemoryPool)i);
+		fprintf(m_profile_log, "{\"event\":\"pool\",\"name\":\"%s\",\"blocks\":%zu,\"allocations\":%zu,\"bytes\":%llu,\"used_bytes\":%llu,\"largest_free\":%llu}\n",
+			stats.name, stats.block_count, stats.allocation_count, (unsigned long long)stats.size, (unsigned long long)stats.used, (unsigned long long)stats.largest_free);
+	}
+	destroy_profiler();
+	for(DeferredBuffer& deferred : m_destroy_after_transfer_deque)
+		destroy_buffer(&deferred.buf); //recorded but never submitted
+	m_destroy_after_transfer_deque.clear();
+
+	destroy_buffer(&m_staging_buf);
+	destroy_buffer(&m_scene_buf);
+	destroy_buffer(&m_bvh_buf);
+	destroy_buffer(&m_sphere_geom_buf);
+	destroy_buffer(&m_accum_buf);
+	destroy_buffer(&m_params_buf);
+	if(m_integrator == INTEGRATOR_WAVEFRONT)
+	{
+		destroy_path_queues();
+		destroy_buffer(&m_light_buf);
+	}
+	destroy_pool(POOL_SCENE);
+	destroy_pool(POOL_STAGING);
+	for(uint32_t i = 0; i < m_slot_count; i++)
+		vkDestroyFence(m_dev, m_c_fence_array[i], nullptr);
+	vkDestroyFence(m_dev, m_t_fence, nullptr);
+	for(uint32_t i = 0; i < m_c_queue_count; i++)
+	{
+		vkDestroySemaphore(m_dev, m_t_semaphore_array[i], nullptr);
+		vkDestroySemaphore(m_dev, m_c_semaphore_array[i], nullptr);
+	}
+
+	save_pipeline_cache();
+	vkDestroyPipelineCache(m_dev, m_pipeline_cache, nullptr);
+
+	vkDestroyPipeline(m_dev, m_compute_pipeline, nullptr);
+	for(uint32_t i = 0; i < WF_STAGE_COUNT; i++)
+		vkDestroyPipeline(m_dev, m_wf_pipeline_array[i], nullptr);
+	vkDestroyPipelineLayout(m_dev, m_pipeline_layout, nullptr);
+	vkDestroyDescriptorSetLayout(m_dev, m_dset_layout, nullptr);
+	vkDestroyDescriptorPool(m_dev, m_descriptor_pool, nullptr);
+
+	vkDestroyCommandPool(m_dev, m_t_cmd_pool, nullptr);
+	for(uint32_t i = 0; i < m_c_queue_count; i++)
+		vkDestroyCommandPool(m_dev, m_c_cmd_pool_array[i], nullptr);
+	vmaDestroyAllocator(m_vma);
+	vkDestroyDevice(m_dev, nullptr);
+	vkDestroyInstance(m_instance, nullptr);
+	//no cleanup for volk
+}
+
+
+//traces one sample for every pixel, split into as many tile submissions as the budget requires
+void
+Renderer::render_frame()
+{
+	while(!render_tile())
+		;
+}
+
+//blocks until every submitted tile, on every compute queue, has finished
+void
+Renderer::wait_for_tiles()
+{
+	CHECKVK(vkWaitForFences(m_dev, m_slot_count, m_c_fence_array, VK_TRUE, UINT64_MAX),
+		"failed to wait for frame fences!");
+}
+
+//how many pixels the next tile should cover to stay within the budget
+uint64_t
+Renderer::choose_tile_pixels()
+{
+	uint64_t pixels = default_tile_pixels;
+	if(m_ms_per_pixel > 0.0)
+		pixels = (uint64_t)(m_tile_budget_ms * tile_budget_headroom / m_ms_per_pixel);
+
+	//the cost of the part of the image that hasn't been timed yet is unknown, so grow gradually
+	if(m_last_tile_pixels != 0 && pixels > m_last_tile_pixels * 2)
+		pixels = m_last_tile_pixels * 2;
+
+	//every path of a wavefront tile needs its own slot in the queues
+	if(m_integrator == INTEGRATOR_WAVEFRONT && pixels > m_wf_path_capacity)
+		pixels = m_wf_path_capacity;
+
+	const uint64_t group_pixels = (uint64_t)m_kernel_variant.local_size_x * m_kernel_variant.local_size_y;
+	return pixels < group_pixels ? group_pixels : pixels;
+}
+
+//a dispatch with a begin and end timestamp around it, as long as the slot's query range has room
+//with an indirect buffer the group counts are read from it on the gpu instead
+void
+Renderer::record_dispatch(VkCommandBuffer cmd_buf, uint32_t slot, uint32_t group_count_x, uint32_t group_count_y, 
+	const Buffer* indirect_buf, VkDeviceSize indirect_offset)
+{
+	uint32_t& query_count = m_c_query_count_array[slot];
+	const uint32_t query_base = slot * c_queries_per_slot;
+	const bool timed = m_c_query_pool != VK_NULL_HANDLE && query_count + 2 <= c_queries_per_slot;
+
+	if(timed)
+		vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_c_query_pool, query_base + query_count++);
+
+	if(indirect_buf != nullptr)
+		vkCmdDispatchIndirect(cmd_buf, indirect_buf->handle, indirect_offset);
+	else
+		vkCmdDispatch(cmd_buf, group_count_x, group_count_y, 1);
+
+	if(timed)
+		vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_c_query_pool, query_base + query_count++);
 }
 
+//every path of the tile through generate, then extend, shade, compact and connect once per bounce
+//only generate's size is known here, every later dispatch is sized on the gpu by the queue it reads
+//so bounces where most paths have ended launch only the survivors
+void
+Renderer::record_wavefront(VkCommandBuffer cmd_buf, uint32_t slot, PushConstants* push)
+{
+	const uint32_t group_count = (push->path_count + m_wf_variant.local_size_x - 1) / m_wf_variant.local_size_x;
+
+	//each stage reads what the one before wrote, including the dispatch sizes in m_count_buf,
+	//and the first one overwrites what the previous tile left in the queues
+	VkMemoryBarrier stage_barrier;
+	stage_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	stage_barrier.pNext = nullptr;
+	stage_barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	stage_barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+	const VkPipelineStageFlags stage_mask = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+
+	vkCmdPipelineBarrier(cmd_buf, stage_mask, stage_mask, 0, 1, &stage_barrier, 0, nullptr, 0, nullptr);
+	push->bounce = 0;
+	vkCmdPushConstants(cmd_buf, m_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), push);
+	vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, m_wf_pipeline_array[WF_GENERATE]);
+	record_dispatch(cmd_buf, slot, group_count, 1);
+
+	for(uint32_t bounce = 0; bounce <= m_wf_variant.max_bounces; bounce++)
+	{
+		//push constants stay bound across pipeline changes, the layout is shared
+		push->bounce = bounce;
+		vkCmdPushConstants(cmd_buf, m_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), push);
+
+		//extend, shade and compact walk the queue of this bounce's parity, connect the light samples compact packed
+		const VkDeviceSize cur_counts = (bounce & 1) * queue_counts_size;
+		const VkDeviceSize next_counts = ((bounce + 1) & 1) * queue_counts_size;
+		const VkDeviceSize indirect_offset_array[WF_STAGE_COUNT] = {
+			0,
+			cur_counts + ray_dispatch_offset,
+			cur_counts + ray_dispatch_offset,
+			cur_counts + ray_dispatch_offset,
+			next_counts + shadow_dispatch_offset,
+		};
+
+		for(uint32_t stage = WF_EXTEND; stage < WF_STAGE_COUNT; stage++)
+		{
+			vkCmdPipelineBarrier(cmd_buf, stage_mask, stage_mask, 0, 1, &stage_barrier, 0, nullptr, 0, nullptr);
+			vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, m_wf_pipeline_array[stage]);
+			record_dispatch(cmd_buf, slot, 0, 0, &m_count_buf, indirect_offset_array[stage]);
+		}
+	}
+}
 
+//records and submits the next tile of the current sweep, returns true once the sweep is complete
+//only the submission that last used this frame slot is waited on, so the one before keeps the gpu busy while we record
+//each finished tile is immediately visible to save_image, the accumulation buffer keeps a sample count per pixel
 bool
-Renderer::copy_to_buffer(VkCommandBuffer cmd_buf, Buffer* buf, const void* data, const size_t size)
+Renderer::render_tile()
 {
-	if(size > buf->size)
-		return false;
+	const uint32_t slot = m_frame_idx % m_slot_count;
+	VkCommandBuffer cmd_buf = m_c_cmd_buf_array[slot];
+	VkFence fence = m_c_fence_array[slot];
+	VkQueue queue = m_c_queue_array[slot % m_c_queue_count];
 
+	//frees staging memory of uploads that finished since the last pass without waiting on them
+	//the tile itself is ordered after them by the transfer semaphore
+	retire_transfers(false);
+	check_memory_budget();
 
-	Buffer staging_buf;
+	//tiles of one sweep never overlap, so only a new sweep has to wait for the tiles on the other queues,
+	//which may still be adding the previous sample to the same pixels
+	if(m_c_queue_count > 1 && m_tile_cursor[0] == 0 && m_tile_cursor[1] == m_region[0])
+		wait_for_tiles();
 
-	VkBufferCreateInfo buf_cinfo;
-	buf_cinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	buf_cinfo.pNext = nullptr;
-	buf_cinfo.flags = 0; 
-	buf_cinfo.size = size;
-	buf_cinfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT; 
-	buf_cinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-	buf_cinfo.queueFamilyIndexCount = 0;
-	buf_cinfo.pQueueFamilyIndices = nullptr;
+	CHECKVK(vkWaitForFences(m_dev, 1, &fence, VK_TRUE, UINT64_MAX),
+		"failed to wait for frame fence!");
+	CHECKVK(vkResetFences(m_dev, 1, &fence),
+		"failed to reset frame fence!");
 
-	VmaAllocationCreateInfo ainfo = {};
-	ainfo.usage = VMA_MEMORY_USAGE_CPU_TO_GPU;
+	//the submission that last used this slot has finished, so its timestamps are ready without waiting
+	//and the tile size below already accounts for it
+	collect_pass_stats(slot);
 
 
-	if(vmaCreateBuffer(m_vma, &buf_cinfo, &ainfo, &staging_buf.handle, &staging_buf.alloc, nullptr) != VK_SUCCESS)
-		return false;
+	//tiles are whole multiples of the workgroup size except at the right and bottom edge
+	//so neighbouring tiles never overlap
+	const uint32_t group_x = m_kernel_variant.local_size_x;
+	const uint32_t group_y = m_kernel_variant.local_size_y;
+	const uint64_t tile_pixels = choose_tile_pixels();
+
+	const uint32_t tile_x = m_tile_cursor[0];
+	const uint32_t tile_y = m_tile_cursor[1];
+
+	if(tile_x == 0)
+	{
+		//start of a band, take as many whole rows as fit
+		uint64_t rows = tile_pixels / (uint64_t)m_width / group_y * group_y;
+		if(rows < group_y)
+			rows = group_y;
+		m_band_h = rows < (uint64_t)(m_region[1] - tile_y) ? (uint32_t)rows : m_region[1] - tile_y;
+	}
 
+	uint32_t tile_w = m_width - tile_x;
+	if((uint64_t)tile_w * m_band_h > tile_pixels)
 	{
-		void* memory;
-		vmaMapMemory(m_vma, staging_buf.alloc, &memory);
-			memcpy(memory, data, size);
-		vmaUnmapMemory(m_vma, staging_buf.alloc);
+		//even one band is over budget, split it
+		uint64_t cols = tile_pixels / m_band_h / group_x * group_x;
+		if(cols < group_x)
+			cols = group_x;
+		if(cols < tile_w)
+			tile_w = (uint32_t)cols;
 	}
+	const uint32_t tile_h = m_band_h;
+	m_last_tile_pixels = (uint64_t)tile_w * tile_h;
+
+
+	//recorded inline, so a tile needs no host to device copy
+	PushConstants push;
+	push.camera = m_camera_frame;
+	push.sample_idx = m_sample_idx;
+	push.seed = m_seed;
+	push.tile_origin[0] = tile_x;
+	push.tile_origin[1] = tile_y;
+	push.stats_slot = slot;
+	push.bounce = 0;
+	push.tile_size[0] = tile_w;
+	push.tile_size[1] = tile_h;
+	push.path_count = tile_w * tile_h;
+	push.pad = 0;
+
+
+	VkCommandBufferBeginInfo begin_info;
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.pNext = nullptr;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	begin_info.pInheritanceInfo = nullptr;
+
+	CHECKVK(vkBeginCommandBuffer(cmd_buf, &begin_info),
+		"failed to begin compute command buffer!");
+
+	const uint32_t query_base = slot * c_queries_per_slot;
+	if(m_c_query_pool != VK_NULL_HANDLE)
+		vkCmdResetQueryPool(cmd_buf, m_c_query_pool, query_base, c_queries_per_slot);
 
-	//transfer ownership from compute queue to transfer queue
 	VkBufferMemoryBarrier barrier{};
 	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
-	barrier.srcQueueFamilyIndex = m_c_queue_idx;
-	barrier.dstQueueFamilyIndex = m_t_queue_idx;
-	barrier.buffer = buf->handle;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = m_accum_buf.handle;
 	barrier.size = VK_WHOLE_SIZE;
 
-	vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,  VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	if(m_accum_reset)
+	{
+		//the previous tile on this queue may still be accumulating into it, and a queued export copying it
+		barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+		vkCmdFillBuffer(cmd_buf, m_accum_buf.handle, 0, VK_WHOLE_SIZE, 0);
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	}
+	else
+	{
+		//the previous tile on this queue accumulates into the same buffer
+		//and an export may have queued a snapshot copy of it in between
+		barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	}
+
+	m_c_query_count_array[slot] = 0;
+	vkCmdBindDescriptorSets(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline_layout, 0, 1, &m_dset, 0, nullptr);
+
+	if(m_integrator == INTEGRATOR_WAVEFRONT)
+		record_wavefront(cmd_buf, slot, &push);
+	else
+	{
+		vkCmdBindPipeline(cmd_buf, VK_PIPELINE_BIND_POINT_COMPUTE, m_compute_pipeline);
+		vkCmdPushConstants(cmd_buf, m_pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstants), &push);
+		record_dispatch(cmd_buf, slot, (tile_w + group_x - 1) / group_x, (tile_h + group_y - 1) / group_y);
+	}
+
+	m_slot_pass_idx_array[slot] = m_frame_idx;
+	m_slot_sample_count_array[slot] = (uint64_t)tile_w * tile_h;
+	m_slot_sample_idx_array[slot] = m_sample_idx;
+	m_slot_tile_array[slot][0] = tile_x;
+	m_slot_tile_array[slot][1] = tile_y;
+	m_slot_tile_array[slot][2] = tile_w;
+	m_slot_tile_array[slot][3] = tile_h;
+
+	CHECKVK(vkEndCommandBuffer(cmd_buf),
+		"failed to end compute command buffer!");
+
+
+	//the first tile on this queue since an upload waits for it on the gpu
+	const uint32_t queue_idx = slot % m_c_queue_count;
+	const VkPipelineStageFlags upload_wait_stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	const bool upload_wait = m_t_semaphore_pending_array[queue_idx];
+	m_t_semaphore_pending_array[queue_idx] = false;
+	m_c_queue_used_array[queue_idx] = true;
+
+	VkSubmitInfo submit_info;
+	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit_info.pNext = nullptr;
+	submit_info.waitSemaphoreCount = upload_wait ? 1 : 0;
+	submit_info.pWaitSemaphores = &m_t_semaphore_array[queue_idx];
+	submit_info.pWaitDstStageMask = &upload_wait_stage;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &cmd_buf;
+	submit_info.signalSemaphoreCount = 0;
+	submit_info.pSignalSemaphores = nullptr;
+
+	CHECKVK(vkQueueSubmit(queue, 1, &submit_info, fence),
+		"failed to submit tile!");
+
+	//the clear covers the whole image, so the rest of the sweep can't start on other queues until it is done
+	if(m_accum_reset && m_c_queue_count > 1)
+	{
+		CHECKVK(vkWaitForFences(m_dev, 1, &fence, VK_TRUE, UINT64_MAX),
+			"failed to wait for frame fence!");
+	}
+
+	m_accum_reset = false;
+	m_frame_idx++;
+
+	//advance through the band, then to the next band, then to the next sweep
+	m_tile_cursor[0] += tile_w;
+	if(m_tile_cursor[0] < (uint32_t)m_width)
+		return false;
+
+	m_tile_cursor[0] = 0;
+	m_tile_cursor[1] += tile_h;
+	if(m_tile_cursor[1] < m_region[1])
+		return false;
+
+	m_tile_cursor[1] = m_region[0];
+	m_sample_idx++;
+	return true;
+}
+
+
+bool
+Renderer::create_readback_resources()
+{
+	//the readback buffer is needed for any export, the snapshot only lets tracing continue sooner
+	const size_t accum_size = m_accum_buf.size;
+	if(!create_buffer(&m_readback_buf, accum_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU))
+	{
+		fprintf(stderr, "failed to create readback buffer!\n");
+		return false;
+	}
+	if(!create_buffer(&m_snapshot_buf, accum_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VMA_MEMORY_USAGE_GPU_ONLY, true, 
+		VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT))
+		fprintf(stderr, "WARNING: no room in the memory budget for an export snapshot, exports will hold up tracing\n");
+
+	//separate from m_t_cmd_pool, which is reset wholesale by every upload batch
+	VkCommandPoolCreateInfo pool_cinfo;
+	pool_cinfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	pool_cinfo.pNext = nullptr;
+	pool_cinfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+	pool_cinfo.queueFamilyIndex = m_t_queue_idx;
+
+	CHECKVK(vkCreateCommandPool(m_dev, &pool_cinfo, nullptr, &m_r_cmd_pool), 
+		"failed to create readback command pool!");
+
+	VkCommandBufferAllocateInfo alloc_info;
+	alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	alloc_info.pNext = nullptr;
+	alloc_info.commandPool = m_r_cmd_pool;
+	alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	alloc_info.commandBufferCount = 1;
+
+	CHECKVK(vkAllocateCommandBuffers(m_dev, &alloc_info, &m_r_cmd_buf),
+		"failed to allocate readback command buffer!");
+
+	alloc_info.commandPool = m_c_cmd_pool_array[0];
+	CHECKVK(vkAllocateCommandBuffers(m_dev, &alloc_info, &m_c_snapshot_cmd_buf),
+		"failed to allocate snapshot command buffer!");
+
+	VkSemaphoreCreateInfo sem_cinfo;
+	sem_cinfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	sem_cinfo.pNext = nullptr;
+	sem_cinfo.flags = 0;
+
+	CHECKVK(vkCreateSemaphore(m_dev, &sem_cinfo, nullptr, &m_snapshot_semaphore),
+		"failed to create snapshot semaphore!");
+
+	VkFenceCreateInfo fence_cinfo;
+	fence_cinfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	fence_cinfo.pNext = nullptr;
+	fence_cinfo.flags = 0;
+
+	CHECKVK(vkCreateFence(m_dev, &fence_cinfo, nullptr, &m_r_fence),
+		"failed to create readback fence!");
+	return true;
+}
+
+void
+Renderer::destroy_readback_resources()
+{
+	if(m_r_cmd_pool == VK_NULL_HANDLE)
+		return;
+
+	destroy_buffer(&m_snapshot_buf);
+	destroy_buffer(&m_readback_buf);
+	vkFreeCommandBuffers(m_dev, m_c_cmd_pool_array[0], 1, &m_c_snapshot_cmd_buf);
+	vkDestroyCommandPool(m_dev, m_r_cmd_pool, nullptr);
+	vkDestroySemaphore(m_dev, m_snapshot_semaphore, nullptr);
+	vkDestroyFence(m_dev, m_r_fence, nullptr);
+	m_r_cmd_pool = VK_NULL_HANDLE;
+}
+
+//queues a copy of everything accumulated up to the last submitted tile and returns without waiting for it
+//consume gets the copy in host memory on a background thread, only one export is in flight at a time
+bool
+Renderer::export_accum(const std::function<void(const float*)>& consume)
+{
+	if(m_frame_idx == 0)
+	{
+		fprintf(stderr, "nothing has been rendered yet!\n");
+		return false;
+	}
+
+	//only blocks if the previous export is still being written
+	if(m_writer_thread.joinable())
+		m_writer_thread.join();
+
+	if(m_r_cmd_pool == VK_NULL_HANDLE && !create_readback_resources())
+		return false;
+
+
+	VkCommandBufferBeginInfo begin_info;
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.pNext = nullptr;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	begin_info.pInheritanceInfo = nullptr;
+
+	//with more than one compute queue the latest tiles may be on any of them
+	if(m_c_queue_count > 1)
+		wait_for_tiles();
+
+	//compute queue: a fast device local copy right behind the latest tile
+	CHECKVK(vkBeginCommandBuffer(m_c_snapshot_cmd_buf, &begin_info),
+		"failed to begin snapshot command buffer!");
+
+	VkMemoryBarrier mem_barrier;
+	mem_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	mem_barrier.pNext = nullptr;
+	mem_barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	mem_barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	vkCmdPipelineBarrier(m_c_snapshot_cmd_buf, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &mem_barrier, 0, nullptr, 0, nullptr);
 
 	VkBufferCopy copy_region;
 	copy_region.srcOffset = 0;
 	copy_region.dstOffset = 0;
-	copy_region.size = size;
+	copy_region.size = m_accum_buf.size;
+
+	//without a snapshot the compute queue does the slow copy to host memory itself, and the transfer queue isn't used
+	const bool direct = m_snapshot_buf.handle == VK_NULL_HANDLE;
+	vkCmdCopyBuffer(m_c_snapshot_cmd_buf, m_accum_buf.handle, direct ? m_readback_buf.handle : m_snapshot_buf.handle, 1, &copy_region);
+	if(direct)
+	{
+		mem_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		mem_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(m_c_snapshot_cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &mem_barrier, 0, nullptr, 0, nullptr);
+	}
+
+	CHECKVK(vkEndCommandBuffer(m_c_snapshot_cmd_buf),
+		"failed to end snapshot command buffer!");
+
+	CHECKVK(vkResetFences(m_dev, 1, &m_r_fence),
+		"failed to reset readback fence!");
+
+	VkSubmitInfo submit_info;
+	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit_info.pNext = nullptr;
+	submit_info.waitSemaphoreCount = 0;
+	submit_info.pWaitSemaphores = nullptr;
+	submit_info.pWaitDstStageMask = nullptr;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &m_c_snapshot_cmd_buf;
+	submit_info.signalSemaphoreCount = direct ? 0 : 1;
+	submit_info.pSignalSemaphores = direct ? nullptr : &m_snapshot_semaphore;
+
+	CHECKVK(vkQueueSubmit(m_c_queue_array[0], 1, &submit_info, direct ? m_r_fence : VK_NULL_HANDLE),
+		"failed to submit snapshot!");
+
+	//tiles on the other queues aren't ordered against the copy, so it has to be done before any more are submitted
+	if(m_c_queue_count > 1)
+	{
+		CHECKVK(vkQueueWaitIdle(m_c_queue_array[0]),
+			"failed to wait for snapshot!");
+	}
+
+
+	//transfer queue: the slow copy into host memory, overlapping the next passes
+	if(!direct)
+	{
+		CHECKVK(vkBeginCommandBuffer(m_r_cmd_buf, &begin_info),
+			"failed to begin readback command buffer!");
+
+		vkCmdCopyBuffer(m_r_cmd_buf, m_snapshot_buf.handle, m_readback_buf.handle, 1, &copy_region);
+
+		mem_barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		mem_barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(m_r_cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &mem_barrier, 0, nullptr, 0, nullptr);
 
-	vkCmdCopyBuffer(cmd_buf, staging_buf.handle, buf->handle, 1, &copy_region);
+		CHECKVK(vkEndCommandBuffer(m_r_cmd_buf),
+			"failed to end readback command buffer!");
 
+		const VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+		submit_info.waitSemaphoreCount = 1;
+		submit_info.pWaitSemaphores = &m_snapshot_semaphore;
+		submit_info.pWaitDstStageMask = &wait_stage;
+		submit_info.pCommandBuffers = &m_r_cmd_buf;
+		submit_info.signalSemaphoreCount = 0;
+		submit_info.pSignalSemaphores = nullptr;
+
+		CHECKVK(vkQueueSubmit(m_t_queue, 1, &submit_info, m_r_fence),
+			"failed to submit readback!");
+	}
 
-	//transfer ownership back to compute queue
-	barrier.srcQueueFamilyIndex = m_t_queue_idx;
-	barrier.dstQueueFamilyIndex = m_c_queue_idx;
 
-	vkCmdPipelineBarrier(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT,  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+	m_writer_done = false;
+	m_writer_thread = std::thread([this, consume]()
+	{
+		if(vkWaitForFences(m_dev, 1, &m_r_fence, VK_TRUE, UINT64_MAX) != VK_SUCCESS)
+			fprintf(stderr, "failed to wait for readback!\n");
+		else
+		{
+			vmaInvalidateAllocation(m_vma, m_readback_buf.alloc, 0, VK_WHOLE_SIZE);
+			consume((const float*)m_readback_buf.mapped);
+		}
+		m_writer_done = true;
+	});
 
-	m_destroy_after_transfer_vec.push_back(staging_buf);
 	return true;
+}
+
+//the image is encoded on the export's background thread
+bool
+Renderer::save_image(const char* path)
+{
+	const std::string path_copy = path;
+	const int width = m_width;
+	const int height = m_height;
+	return export_accum([path_copy, width, height](const float* accum)
+	{
+		write_image(path_copy.c_str(), accum, width, height);
+	});
+}
+
+//blocks until the copy is in dst, which needs room for width * height * 4 floats
+bool
+Renderer::read_accum(float* dst)
+{
+	const size_t size = m_accum_buf.size;
+	if(!export_accum([dst, size](const float* accum){ memcpy(dst, accum, size); }))
+		return false;
 
+	m_writer_thread.join();
+	return true;
+}
+
+
+//moving the camera invalidates everything accumulated so far, the next pass starts from zero
+void
+Renderer::set_camera(const Camera& camera)
+{
+	m_scene.camera = camera;
+	make_camera_frame(m_scene.camera, m_width, m_height, &m_camera_frame);
+	m_accum_reset = true;
+
+	//a half finished sweep would leave some pixels a sample ahead of the others
+	m_tile_cursor[0] = 0;
+	m_tile_cursor[1] = m_region[0];
+	m_sample_idx = 0;
+}
+
+//the next sweep starts at the top of the new region, pixels outside it keep what they have accumulated
+//meant to be called between frames, a sweep cut short leaves some of its pixels a sample behind
+void
+Renderer::set_region(uint32_t row_begin, uint32_t row_end)
+{
+	if(row_end > (uint32_t)m_height)
+		row_end = m_height;
+	if(row_begin >= row_end)
+		row_begin = row_end > 0 ? row_end - 1 : 0;
+
+	m_region[0] = row_begin;
+	m_region[1] = row_end;
+	m_tile_cursor[0] = 0;
+	m_tile_cursor[1] = row_begin;
+}
+
+void
+Renderer::set_seed(uint32_t seed)
+{
+	m_seed = seed;
+}
+
+//the device is picked by its index in enumeration order instead of by choose_pdev's rules
+//for renderers driven by another one, so it also leaves the shared pipeline cache and profile log alone
+void
+Renderer::set_device(uint32_t pdev_idx)
+{
+	m_pinned_pdev_idx = (int)pdev_idx;
+}
+
+uint32_t
+Renderer::device_count() const
+{
+	uint32_t pdev_count = 0;
+	vkEnumeratePhysicalDevices(m_instance, &pdev_count, nullptr);
+	return pdev_count;
+}
+
+void
+Renderer::set_tile_budget(double ms)
+{
+	if(ms <= 0.0)
+	{
+		fprintf(stderr, "WARNING: ignoring tile budget of %f ms\n", ms);
+		return;
+	}
+	m_tile_budget_ms = ms;
+}
+
+
+
+
+//concurrent buffers can be used from both the compute and transfer queue without ownership transfers
+bool 
+Renderer::create_buffer(Buffer* buf, const size_t size, VkBufferUsageFlags usage, VmaMemoryUsage mem_usage, bool concurrent, 
+	VmaAllocationCreateFlags alloc_flags, MemoryPool pool)
+{
+	const uint32_t family_array[2] = { m_c_queue_idx, m_t_queue_idx };
+
+	VkBufferCreateInfo buf_cinfo;
+	buf_cinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buf_cinfo.pNext = nullptr;
+	buf_cinfo.flags = 0; 
+	buf_cinfo.size = size;
+	buf_cinfo.usage = usage; 
+	buf_cinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	buf_cinfo.queueFamilyIndexCount = 0;
+	buf_cinfo.pQueueFamilyIndices = nullptr;
+
+	if(concurrent && m_c_queue_idx != m_t_queue_idx)
+	{
+		buf_cinfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		buf_cinfo.queueFamilyIndexCount = 2;
+		buf_cinfo.pQueueFamilyIndices = family_array;
+	}
+
+	VmaAllocationCreateInfo ainfo = {};
+	ainfo.usage = mem_usage;
+	ainfo.flags = alloc_flags;
+	ainfo.pool = m_pool_array[pool];
+	if(mem_usage != VMA_MEMORY_USAGE_GPU_ONLY)
+		ainfo.flags |= VMA_ALLOCATION_CREATE_MAPPED_BIT;
+	else if(alloc_flags & VMA_ALLOCATION_CREATE_MAPPED_BIT)
+		ainfo.preferredFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT; //only used if it falls back to the default heaps, mapped is null if it doesn't get it
+
+	buf->size = size;
+
+	//a buffer bigger than what is left in its pool's blocks goes to the default heaps rather than failing
+	VmaAllocationInfo alloc_info;
+	if(vmaCreateBuffer(m_vma, &buf_cinfo, &ainfo, &buf->handle, &buf->alloc, &alloc_info) != VK_SUCCESS)
+	{
+		ainfo.pool = VK_NULL_HANDLE;
+		if(pool == POOL_DEFAULT || vmaCreateBuffer(m_vma, &buf_cinfo, &ainfo, &buf->handle, &buf->alloc, &alloc_info) != VK_SUCCESS)
+			return false;
+	}
+
+	buf->mapped = alloc_info.pMappedData;
+	return true;
+}
+
+//the memory type is picked for buffers like the ones the pool will hold, with the same usage flags
+//linear pools get a single block, so freeing in allocation order lets vma use it as a ring
+bool
+Renderer::create_pool(MemoryPool pool, VkBufferUsageFlags usage, VmaMemoryUsage mem_usage, VmaPoolCreateFlags flags, VkDeviceSize block_size, 
+	VkMemoryPropertyFlags required_flags)
+{
+	VkBufferCreateInfo buf_cinfo;
+	buf_cinfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	buf_cinfo.pNext = nullptr;
+	buf_cinfo.flags = 0;
+	buf_cinfo.size = block_size != 0 ? block_size : 1;
+	buf_cinfo.usage = usage;
+	buf_cinfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	buf_cinfo.queueFamilyIndexCount = 0;
+	buf_cinfo.pQueueFamilyIndices = nullptr;
+
+	VmaAllocationCreateInfo ainfo = {};
+	ainfo.usage = mem_usage;
+	ainfo.requiredFlags = required_flags;
+
+	VmaPoolCreateInfo pool_cinfo = {};
+	if(vmaFindMemoryTypeIndexForBufferInfo(m_vma, &buf_cinfo, &ainfo, &pool_cinfo.memoryTypeIndex) != VK_SUCCESS)
+		return false;
+
+	//pools only ever hold buffers
+	pool_cinfo.flags = flags | VMA_POOL_CREATE_IGNORE_BUFFER_IMAGE_GRANULARITY_BIT;
+	pool_cinfo.blockSize = block_size;
+	pool_cinfo.minBlockCount = 0;
+	pool_cinfo.maxBlockCount = (flags & VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT) ? 1 : 0;
+
+	if(vmaCreatePool(m_vma, &pool_cinfo, &m_pool_array[pool]) != VK_SUCCESS)
+		return false;
+
+	vmaSetPoolName(m_vma, m_pool_array[pool], pool_name_array[pool]);
+	return true;
+}
+
+//true if a host visible memory type sits on the main device local heap, as with resizable bar, integrated gpus and software vulkan
+//a small bar window in front of a bigger vram heap doesn't count, it's too scarce to put a scene in
+//RP_DIRECT_UPLOAD=0 turns it off, to compare against uploads through the transfer queue
+bool
+Renderer::has_direct_upload_memory()
+{
+	if(const char* env = getenv("RP_DIRECT_UPLOAD"))
+	{
+		if(strcmp(env, "0") == 0)
+			return false;
+	}
+
+	const VkPhysicalDeviceMemoryProperties* mem_props;
+	vmaGetMemoryProperties(m_vma, &mem_props);
+
+	VkDeviceSize largest_heap = 0;
+	for(uint32_t i = 0; i < mem_props->memoryHeapCount; i++)
+	{
+		if(mem_props->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+			largest_heap = std::max(largest_heap, mem_props->memoryHeaps[i].size);
+	}
+
+	const VkMemoryPropertyFlags direct_flags = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+	for(uint32_t i = 0; i < mem_props->memoryTypeCount; i++)
+	{
+		const VkMemoryType& type = mem_props->memoryTypes[i];
+		if((type.propertyFlags & direct_flags) == direct_flags && mem_props->memoryHeaps[type.heapIndex].size >= largest_heap)
+			return true;
+	}
+	return false;
+}
+
+//every buffer allocated from the pool has to be destroyed first
+void
+Renderer::destroy_pool(MemoryPool pool)
+{
+	if(m_pool_array[pool] == VK_NULL_HANDLE)
+		return;
+
+	vmaDestroyPool(m_vma, m_pool_array[pool]);
+	m_pool_array[pool] = VK_NULL_HANDLE;
+}
+
+PoolStats
+Renderer::pool_stats(MemoryPool pool) const
+{
+	PoolStats stats = {};
+	stats.name = pool_name_array[pool];
+	if(m_pool_array[pool] == VK_NULL_HANDLE)
+		return stats;
+
+	VmaPoolStats vma_stats;
+	vmaGetPoolStats(m_vma, m_pool_array[pool], &vma_stats);
+	stats.block_count = vma_stats.blockCount;
+	stats.allocation_count = vma_stats.allocationCount;
+	stats.size = vma_stats.size;
+	stats.used = vma_stats.size - vma_stats.unusedSize;
+	stats.largest_free = vma_stats.unusedRangeSizeMax;
+	return stats;
+}
+
+void 
+Renderer::destroy_buffer(Buffer* buf)
+{
+	vmaDestroyBuffer(m_vma, buf->handle, buf->alloc);
+	buf->handle = VK_NULL_HANDLE;
+	buf->alloc = VK_NULL_HANDLE; //vma frees a non null allocation even without a buffer, so a second destroy must see nothing
+	buf->mapped = nullptr;
+}
+
+//summed over the device local heaps, with VK_EXT_memory_budget the driver's numbers for this process,
+//without it vma's estimate from the heap sizes and its own allocations
+void
+Renderer::device_memory_budget(VkDeviceSize* budget, VkDeviceSize* usage)
+{
+	const VkPhysicalDeviceMemoryProperties* mem_props;
+	vmaGetMemoryProperties(m_vma, &mem_props);
+
+	VmaBudget budget_array[VK_MAX_MEMORY_HEAPS];
+	vmaGetBudget(m_vma, budget_array);
+
+	*budget = 0;
+	*usage = 0;
+	for(uint32_t i = 0; i < mem_props->memoryHeapCount; i++)
+	{
+		if(mem_props->memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+		{
+			*budget += budget_array[i].budget;
+			*usage += budget_array[i].usage;
+		}
+	}
+}
+
+VkDeviceSize
+Renderer::device_memory_available()
+{
+	VkDeviceSize budget, usage;
+	device_memory_budget(&budget, &usage);
+	return budget > usage ? budget - usage : 0;
+}
+
+//other processes on the gpu can shrink the budget at any time, so once over it,
+//give back what can be rebuilt smaller rather than wait for allocations to start failing
+void
+Renderer::check_memory_budget()
+{
+	//vma only refreshes the budget from the driver when the frame index changes
+	vmaSetCurrentFrameIndex(m_vma, (uint32_t)m_frame_idx);
+	if(m_frame_idx % budget_check_interval != 0)
+		return;
+
+	VkDeviceSize budget, usage;
+	device_memory_budget(&budget, &usage);
+	if(usage <= budget)
+		return;
+
+	fprintf(stderr, "WARNING: over the device memory budget, %u of %u MB in use\n", (uint32_t)(usage >> 20), (uint32_t)(budget >> 20));
+
+	//the export buffers are recreated by the next save_image, unless an export is still being written
+	if(m_r_cmd_pool != VK_NULL_HANDLE && (!m_writer_thread.joinable() || m_writer_done))
+	{
+		if(m_writer_thread.joinable())
+			m_writer_thread.join();
+		destroy_readback_resources();
+	}
+
+	if(m_integrator != INTEGRATOR_WAVEFRONT || m_wf_path_capacity <= min_wavefront_path_capacity)
+		return;
+
+	//the queues are shared by both frame slots, so nothing may be tracing while they're swapped
+	wait_for_tiles();
+
+	const uint32_t capacity = m_wf_path_capacity / 2;
+	destroy_path_queues();
+	if(!create_path_queues(capacity) && !create_path_queues(min_wavefront_path_capacity))
+	{
+		fprintf(stderr, "failed to create wavefront buffers!\n");
+		exit(1);
+	}
+	write_descriptor_sets();
+
+	fprintf(stderr, "WARNING: wavefront tiles limited to %u paths\n", m_wf_path_capacity);
+	if(m_profile_log != nullptr)
+		fprintf(m_profile_log, "{\"event\":\"memory_budget\",\"budget_mb\":%u,\"usage_mb\":%u,\"path_capacity\":%u}\n",
+			(uint32_t)(budget >> 20), (uint32_t)(usage >> 20), m_wf_path_capacity);
+}
+
+//for buffers read by the transfer batch currently being recorded
+void
+Renderer::destroy_buffer_after_transfer(const Buffer& buf)
+{
+	m_destroy_after_transfer_deque.push_back({ buf, m_t_submit_count + 1 });
+	m_pending_reclaim_bytes += buf.size;
+}
+
+
+//a batch of one, recorded into cmd_buf straight away, which has to be m_t_cmd_buf so submit_transfer orders the passes after it
+bool
+Renderer::copy_to_buffer(VkCommandBuffer cmd_buf, Buffer* buf, const void* data, const size_t size)
+{
+	return add_upload(buf, data, size) && record_uploads(cmd_buf);
+}
+
+//queues a range for the next record_uploads, nothing is copied yet, the copy waits for the tiles in flight on the gpu
+//a mapped destination is written straight away instead, the host has to wait for those tiles itself,
+//which costs nothing during init, before any has been submitted
+bool
+Renderer::add_upload(Buffer* buf, const void* data, const size_t size, const size_t dst_offset)
+{
+	if(dst_offset > buf->size || size > buf->size - dst_offset)
+		return false;
+
+	if(size == 0)
+		return true;
+
+	if(buf->mapped != nullptr)
+	{
+		if(m_frame_idx > 0)
+			wait_for_tiles();
+
+		memcpy((char*)buf->mapped + dst_offset, data, size);
+		vmaFlushAllocation(m_vma, buf->alloc, dst_offset, size);
+		m_direct_upload_bytes += size;
+		return true;
+	}
+
+	m_upload_vec.push_back({ buf, data, size, dst_offset });
+	return true;
+}
+
+//packs every queued range into one staging slice and records a single multi-region copy per destination
+//ranges into the same buffer may not overlap, they all land in one vkCmdCopyBuffer
+//destinations are created concurrent, so no queue family owns them and there is nothing to release or acquire,
+//the compute queues are ordered after the copies by the semaphores submit_transfer signals
+bool
+Renderer::record_uploads(VkCommandBuffer cmd_buf)
+{
+	if(m_upload_vec.empty())
+		return true;
+
+	std::vector<UploadRange> range_vec;
+	range_vec.swap(m_upload_vec);
+
+	//grouped by destination, and by offset within one so overlaps are next to each other
+	std::stable_sort(range_vec.begin(), range_vec.end(), [](const UploadRange& a, const UploadRange& b)
+	{
+		return a.buf != b.buf ? a.buf < b.buf : a.dst_offset < b.dst_offset;
+	});
+
+	size_t staging_size = 0;
+	for(size_t i = 0; i < range_vec.size(); i++)
+	{
+		if(i > 0 && range_vec[i].buf == range_vec[i - 1].buf && range_vec[i].dst_offset < range_vec[i - 1].dst_offset + range_vec[i - 1].size)
+		{
+			fprintf(stderr, "overlapping uploads to one buffer!\n");
+			return false;
+		}
+		staging_size += (range_vec[i].size + staging_alignment - 1) & ~(staging_alignment - 1);
+	}
+
+
+	//the ring may flush the batch being recorded to make room, that happens before anything of this one is in it
+	VkBuffer src_handle;
+	size_t src_offset;
+	VmaAllocation src_alloc;
+
+	char* memory = (char*)alloc_staging(staging_size, &src_offset);
+	if(memory != nullptr)
+	{
+		src_handle = m_staging_buf.handle;
+		src_alloc = m_staging_buf.alloc;
+	}
+	else
+	{
+		//larger than the whole ring, fall back to a one off staging buffer, which could never fit in the ring's pool either
+		Buffer staging_buf;
+		if(!create_buffer(&staging_buf, staging_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, false, 0, POOL_DEFAULT))
+			return false;
+
+		destroy_buffer_after_transfer(staging_buf);
+		memory = (char*)staging_buf.mapped;
+		src_handle = staging_buf.handle;
+		src_alloc = staging_buf.alloc;
+		src_offset = 0;
+	}
+
+	std::vector<VkBufferCopy> region_vec(range_vec.size());
+	size_t packed = 0;
+	for(size_t i = 0; i < range_vec.size(); i++)
+	{
+		memcpy(memory + packed, range_vec[i].data, range_vec[i].size);
+		region_vec[i].srcOffset = src_offset + packed;
+		region_vec[i].dstOffset = range_vec[i].dst_offset;
+		region_vec[i].size = range_vec[i].size;
+		packed += (range_vec[i].size + staging_alignment - 1) & ~(staging_alignment - 1);
+		m_t_copy_bytes += range_vec[i].size;
+	}
+	vmaFlushAllocation(m_vma, src_alloc, src_offset, staging_size);
+
+
+	//where each destination's ranges start in region_vec
+	std::vector<size_t> first_region_vec;
+	for(size_t i = 0; i < range_vec.size(); i++)
+	{
+		if(i == 0 || range_vec[i].buf != range_vec[i - 1].buf)
+			first_region_vec.push_back(i);
+	}
+	const size_t dst_count = first_region_vec.size();
+	first_region_vec.push_back(range_vec.size());
+
+	const bool timed = m_t_query_pool != VK_NULL_HANDLE && m_t_query_count + 2 <= max_timed_copies * 2;
+	if(timed)
+		vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_t_query_pool, m_t_query_count++);
+
+	for(size_t i = 0; i < dst_count; i++)
+	{
+		const size_t first = first_region_vec[i];
+		vkCmdCopyBuffer(cmd_buf, src_handle, range_vec[first].buf->handle, (uint32_t)(first_region_vec[i + 1] - first), &region_vec[first]);
+	}
+
+	if(timed)
+		vkCmdWriteTimestamp(cmd_buf, VK_PIPELINE_STAGE_TRANSFER_BIT, m_t_query_pool, m_t_query_count++);
+	m_t_copy_count += (uint32_t)dst_count;
+
+	return true;
+}
+
+//records everything queued by add_upload into its own transfer batch and submits it once on the transfer queue
+bool
+Renderer::submit_uploads()
+{
+	if(m_upload_vec.empty())
+		return true;
+
+	VkCommandBuffer cmd_buf = begin_transfer();
+	const bool ok = record_uploads(cmd_buf);
+	submit_transfer();
+	return ok;
+}
+
+
+VkCommandBuffer
+Renderer::begin_transfer()
+{
+	//the transfer command buffer may only be rerecorded once its last submission has finished
+	retire_transfers(true);
+	CHECKVK(vkResetCommandPool(m_dev, m_t_cmd_pool, 0),
+		"failed to reset transfer command pool!");
+
+	VkCommandBufferBeginInfo begin_info;
+	begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	begin_info.pNext = nullptr;
+	begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	begin_info.pInheritanceInfo = nullptr;
+
+	CHECKVK(vkBeginCommandBuffer(m_t_cmd_buf, &begin_info),
+		"failed to begin transfer command buffer!");
+
+	//the previous batch's timestamps were collected when it retired
+	m_t_query_count = 0;
+	m_t_copy_count = 0;
+	m_t_copy_bytes = 0;
+	if(m_t_query_pool != VK_NULL_HANDLE)
+		vkCmdResetQueryPool(m_t_cmd_buf, m_t_query_pool, 0, max_timed_copies * 2);
+
+	return m_t_cmd_buf;
+}
+
+void
+Renderer::submit_transfer()
+{
+	CHECKVK(vkEndCommandBuffer(m_t_cmd_buf),
+		"failed to end transfer command buffer!");
+	CHECKVK(vkResetFences(m_dev, 1, &m_t_fence),
+		"failed to reset transfer fence!");
+
+	//a semaphore still signalled by an earlier batch no tile has waited for yet is taken back first, it can't be signalled twice
+	//the new signal covers everything submitted to the transfer queue before it, so nothing is lost
+	//tiles already submitted may be reading the buffers this batch writes, so it also waits for every compute queue
+	//that has had some since the last batch, an empty submission signals once all of that queue's earlier work is done
+	VkSemaphore wait_array[2 * max_compute_queues];
+	VkPipelineStageFlags wait_stage_array[2 * max_compute_queues];
+	uint32_t wait_count = 0;
+	for(uint32_t i = 0; i < m_c_queue_count; i++)
+	{
+		if(m_t_semaphore_pending_array[i])
+		{
+			wait_array[wait_count] = m_t_semaphore_array[i];
+			wait_stage_array[wait_count] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+			wait_count++;
+		}
+		m_t_semaphore_pending_array[i] = true;
+
+		if(m_c_queue_used_array[i])
+		{
+			VkSubmitInfo signal_info;
+			signal_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+			signal_info.pNext = nullptr;
+			signal_info.waitSemaphoreCount = 0;
+			signal_info.pWaitSemaphores = nullptr;
+			signal_info.pWaitDstStageMask = nullptr;
+			signal_info.commandBufferCount = 0;
+			signal_info.pCommandBuffers = nullptr;
+			signal_info.signalSemaphoreCount = 1;
+			signal_info.pSignalSemaphores = &m_c_semaphore_array[i];
+
+			CHECKVK(vkQueueSubmit(m_c_queue_array[i], 1, &signal_info, VK_NULL_HANDLE),
+				"failed to signal compute semaphore!");
+			m_c_queue_used_array[i] = false;
+
+			wait_array[wait_count] = m_c_semaphore_array[i];
+			wait_stage_array[wait_count] = VK_PIPELINE_STAGE_TRANSFER_BIT;
+			wait_count++;
+		}
+	}
+
+	VkSubmitInfo submit_info;
+	submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit_info.pNext = nullptr;
+	submit_info.waitSemaphoreCount = wait_count;
+	submit_info.pWaitSemaphores = wait_array;
+	submit_info.pWaitDstStageMask = wait_stage_array;
+	submit_info.commandBufferCount = 1;
+	submit_info.pCommandBuffers = &m_t_cmd_buf;
+	submit_info.signalSemaphoreCount = m_c_queue_count;
+	submit_info.pSignalSemaphores = m_t_semaphore_array;
+
+	CHECKVK(vkQueueSubmit(m_t_queue, 1, &submit_info, m_t_fence),
+		"failed to submit transfer!");
+	m_t_submit_count++;
+
+	//nothing waits here, the staging space is handed back by retire_transfers once the fence has signalled
+}
+
+//releases every staging region whose transfer submission has completed
+void
+Renderer::retire_transfers(bool wait)
+{
+	if(m_t_complete_count < m_t_submit_count)
+	{
+		//there is only ever one transfer submission in flight, so its fence covers all of them
+		VkResult res = wait ? vkWaitForFences(m_dev, 1, &m_t_fence, VK_TRUE, UINT64_MAX) : vkGetFenceStatus(m_dev, m_t_fence);
+		if(res == VK_SUCCESS)
+		{
+			m_t_complete_count = m_t_submit_count;
+			collect_transfer_stats();
+		}
+		else if(res != VK_NOT_READY && res != VK_TIMEOUT)
+		{
+			fprintf(stderr, "%s:%d - failed to query transfer fence!\n", __FILE__, __LINE__);
+			exit(1);
+		}
+	}
+
+	while(!m_staging_region_deque.empty() && m_staging_region_deque.front().submit_id <= m_t_complete_count)
+		m_staging_region_deque.pop_front();
+
+	while(!m_destroy_after_transfer_deque.empty() && m_destroy_after_transfer_deque.front().submit_id <= m_t_complete_count)
+	{
+		Buffer& buf = m_destroy_after_transfer_deque.front().buf;
+		m_pending_reclaim_bytes -= buf.size;
+		m_reclaimed_bytes += buf.size;
+		destroy_buffer(&buf);
+		m_destroy_after_transfer_deque.pop_front();
+	}
+}
+
+
+TransferStats
+Renderer::transfer_stats() const
+{
+	TransferStats stats;
+	stats.submit_count = m_t_submit_count;
+	stats.complete_count = m_t_complete_count;
+	stats.gpu_ms = m_t_gpu_ms;
+	stats.pending_reclaim_bytes = m_pending_reclaim_bytes;
+	stats.pending_reclaim_count = m_destroy_after_transfer_deque.size();
+	stats.reclaimed_bytes = m_reclaimed_bytes;
+	stats.direct_bytes = m_direct_upload_bytes;
+	return stats;
+}
+
+
+//profiling
+
+void
+Renderer::create_profiler()
+{
+	std::vector<VkQueueFamilyProperties> q_props_vec;
+	uint32_t family_count;
+	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, nullptr);
+	q_props_vec.resize(family_count);
+	vkGetPhysicalDeviceQueueFamilyProperties(m_pdev, &family_count, q_props_vec.data());
+
+	const uint32_t c_valid_bits = q_props_vec[m_c_queue_idx].timestampValidBits;
+	const uint32_t t_valid_bits = q_props_vec[m_t_queue_idx].timestampValidBits;
+
+	VkQueryPoolCreateInfo query_cinfo;
+	query_cinfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	query_cinfo.pNext = nullptr;
+	query_cinfo.flags = 0;
+	query_cinfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	query_cinfo.pipelineStatistics = 0;
+
+	if(c_valid_bits != 0)
+	{
+		query_cinfo.queryCount = c_queries_per_slot * m_slot_count;
+		CHECKVK(vkCreateQueryPool(m_dev, &query_cinfo, nullptr, &m_c_query_pool),
+			"failed to create compute query pool!");
+		m_c_timestamp_mask = c_valid_bits >= 64 ? ~0ull : (1ull << c_valid_bits) - 1;
+	}
+	else
+		fprintf(stderr, "WARNING: compute queue can't write timestamps, pass timings disabled\n");
+
+	if(t_valid_bits != 0)
+	{
+		query_cinfo.queryCount = max_timed_copies * 2;
+		CHECKVK(vkCreateQueryPool(m_dev, &query_cinfo, nullptr, &m_t_query_pool),
+			"failed to create transfer query pool!");
+		m_t_timestamp_mask = t_valid_bits >= 64 ? ~0ull : (1ull << t_valid_bits) - 1;
+	}
+
+
+	if(!create_buffer(&m_stats_buf, m_slot_count * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VMA_MEMORY_USAGE_GPU_TO_CPU))
+	{
+		fprintf(stderr, "failed to create stats buffer!\n");
+		exit(1);
+	}
+	memset(m_stats_buf.mapped, 0, m_stats_buf.size);
+	vmaFlushAllocation(m_vma, m_stats_buf.alloc, 0, VK_WHOLE_SIZE);
+
+
+	//json lines, RP_PROFILE_LOG=- writes them to stderr
+	const char* log_path = getenv("RP_PROFILE_LOG");
+	if(log_path != nullptr && m_pinned_pdev_idx < 0)
+	{
+		m_profile_log = strcmp(log_path, "-") == 0 ? stderr : fopen(log_path, "a");
+		if(m_profile_log == nullptr)
+			fprintf(stderr, "WARNING: failed to open profile log %s\n", log_path);
+		else
+			fprintf(m_profile_log, "{\"event\":\"start\",\"render\":\"%s\",\"device\":\"%s\",\"width\":%d,\"height\":%d,\"local_size\":[%u,%u],\"tile_budget_ms\":%.2f,\"integrator\":\"%s\",\"memory_budget\":%s,\"memory_available_mb\":%u,\"path_capacity\":%u,\"compute_queues\":%u,\"direct_upload\":%s}\n",
+				m_render_name, m_pdev_props.deviceName, m_width, m_height, m_kernel_variant.local_size_x, m_kernel_variant.local_size_y, m_tile_budget_ms,
+				m_integrator == INTEGRATOR_WAVEFRONT ? "wavefront" : "megakernel", m_has_memory_budget ? "true" : "false", 
+				(uint32_t)(device_memory_available() >> 20), m_wf_path_capacity, m_c_queue_count, m_direct_upload ? "true" : "false");
+	}
+}
+
+void
+Renderer::destroy_profiler()
+{
+	if(m_c_query_pool != VK_NULL_HANDLE)
+		vkDestroyQueryPool(m_dev, m_c_query_pool, nullptr);
+	if(m_t_query_pool != VK_NULL_HANDLE)
+		vkDestroyQueryPool(m_dev, m_t_query_pool, nullptr);
+	destroy_buffer(&m_stats_buf);
+
+	if(m_profile_log != nullptr && m_profile_log != stderr)
+		fclose(m_profile_log);
+	m_profile_log = nullptr;
+}
+
+//only called once the slot's fence has signaled, so nothing here waits on the gpu
+void
+Renderer::collect_pass_stats(uint32_t slot)
+{
+	const uint32_t query_count = m_c_query_count_array[slot];
+	if(m_slot_sample_count_array[slot] == 0)
+		return;
+
+	PassStats stats = {};
+	stats.pass_idx = m_slot_pass_idx_array[slot];
+	stats.sample_idx = m_slot_sample_idx_array[slot];
+	memcpy(stats.tile, m_slot_tile_array[slot], sizeof(stats.tile));
+	stats.dispatch_count = query_count / 2;
+	stats.sample_count = m_slot_sample_count_array[slot];
+
+	vmaInvalidateAllocation(m_vma, m_stats_buf.alloc, 0, VK_WHOLE_SIZE);
+	uint32_t* ray_counts = (uint32_t*)m_stats_buf.mapped;
+	stats.ray_count = ray_counts[slot];
+	ray_counts[slot] = 0; //made visible to the next pass on this slot by its submit
+	vmaFlushAllocation(m_vma, m_stats_buf.alloc, 0, VK_WHOLE_SIZE);
+
+	if(m_c_query_pool != VK_NULL_HANDLE && query_count >= 2)
+	{
+		uint64_t timestamps[c_queries_per_slot];
+		VkResult res = vkGetQueryPoolResults(m_dev, m_c_query_pool, slot * c_queries_per_slot, query_count, 
+			query_count * sizeof(uint64_t), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+
+		if(res == VK_SUCCESS)
+		{
+			const uint64_t ticks = ((timestamps[query_count - 1] & m_c_timestamp_mask) - (timestamps[0] & m_c_timestamp_mask)) & m_c_timestamp_mask;
+			stats.gpu_ms = (double)ticks * m_pdev_props.limits.timestampPeriod * 1e-6;
+		}
+	}
+
+	if(stats.gpu_ms > 0.0)
+	{
+		stats.samples_per_sec = (double)stats.sample_count / (stats.gpu_ms * 1e-3);
+		stats.rays_per_sec = (double)stats.ray_count / (stats.gpu_ms * 1e-3);
+
+		//feeds the tile size, a tile that was slower than expected counts in full right away
+		//while cheaper ones only pull the estimate down slowly, so an expensive region doesn't overshoot twice
+		const double ms_per_pixel = stats.gpu_ms / (double)stats.sample_count;
+		if(ms_per_pixel > m_ms_per_pixel)
+			m_ms_per_pixel = ms_per_pixel;
+		else
+			m_ms_per_pixel = m_ms_per_pixel * 0.75 + ms_per_pixel * 0.25;
+	}
+
+	m_last_pass_stats = stats;
+	m_slot_sample_count_array[slot] = 0;
+
+	if(m_profile_log != nullptr)
+		fprintf(m_profile_log, "{\"event\":\"pass\",\"pass\":%llu,\"sample\":%u,\"tile\":[%u,%u,%u,%u],\"dispatches\":%u,\"gpu_ms\":%.4f,\"samples\":%llu,\"rays\":%llu,\"samples_per_sec\":%.0f,\"rays_per_sec\":%.0f}\n",
+			(unsigned long long)stats.pass_idx, stats.sample_idx, stats.tile[0], stats.tile[1], stats.tile[2], stats.tile[3],
+			stats.dispatch_count, stats.gpu_ms, (unsigned long long)stats.sample_count, 
+			(unsigned long long)stats.ray_count, stats.samples_per_sec, stats.rays_per_sec);
+}
+
+//called as soon as a transfer batch is known to have completed
+void
+Renderer::collect_transfer_stats()
+{
+	double gpu_ms = 0.0;
+	if(m_t_query_pool != VK_NULL_HANDLE && m_t_query_count >= 2)
+	{
+		std::vector<uint64_t> timestamps(m_t_query_count);
+		VkResult res = vkGetQueryPoolResults(m_dev, m_t_query_pool, 0, m_t_query_count,
+			timestamps.size() * sizeof(uint64_t), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+
+		if(res == VK_SUCCESS)
+		{
+			for(uint32_t i = 0; i + 1 < m_t_query_count; i += 2)
+			{
+				const uint64_t ticks = ((timestamps[i + 1] & m_t_timestamp_mask) - (timestamps[i] & m_t_timestamp_mask)) & m_t_timestamp_mask;
+				gpu_ms += (double)ticks * m_pdev_props.limits.timestampPeriod * 1e-6;
+			}
+		}
+	}
+	m_t_gpu_ms += gpu_ms;
+
+	if(m_profile_log != nullptr && m_t_copy_count != 0)
+		fprintf(m_profile_log, "{\"event\":\"transfer\",\"submit\":%llu,\"copies\":%u,\"timed_copies\":%u,\"bytes\":%zu,\"gpu_ms\":%.4f}\n",
+			(unsigned long long)m_t_complete_count, m_t_copy_count, m_t_query_count / 2, m_t_copy_bytes, gpu_ms);
+
+	//keeps a later retire of the same batch from counting it twice
+	m_t_query_count = 0;
+	m_t_copy_count = 0;
+}
+
+
+PassStats
+Renderer::last_pass_stats() const
+{
+	return m_last_pass_stats;
+}
+
+
+void
+Renderer::create_staging_ring()
+{
+	//a smaller ring only means uploads flush more often, copies bigger than it get their own staging buffer anyway
+	//the pool's block holds just the ring, those one off buffers are bigger than it and come from the default heaps
+	size_t size = staging_ring_size;
+	for(;;)
+	{
+		const VmaAllocationCreateFlags flags = size > min_staging_ring_size ? VMA_ALLOCATION_CREATE_WITHIN_BUDGET_BIT : 0;
+		if(!create_pool(POOL_STAGING, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, VMA_POOL_CREATE_LINEAR_ALGORITHM_BIT, size))
+			fprintf(stderr, "WARNING: failed to create staging pool\n");
+		if(create_buffer(&m_staging_buf, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VMA_MEMORY_USAGE_CPU_TO_GPU, false, flags, POOL_STAGING))
+			break;
+
+		destroy_pool(POOL_STAGING);
+		if(size <= min_staging_ring_size)
+		{
+			fprintf(stderr, "failed to create staging ring!\n");
+			exit(1);
+		}
+		size /= 2;
+	}
+	if(size < staging_ring_size)
+		fprintf(stderr, "WARNING: staging ring shrunk to %u MB to stay within the memory budget\n", (uint32_t)(size >> 20));
+	m_staging_head = 0;
+}
+
+//returns a mapped pointer to size bytes of the staging ring for the batch being recorded, or nullptr if it can never fit
+//only blocks when the space it needs is still being read by a transfer that hasn't finished
+void*
+Renderer::alloc_staging(const size_t size, size_t* offset)
+{
+	const size_t capacity = m_staging_buf.size;
+	const size_t aligned_size = (size + staging_alignment - 1) & ~(staging_alignment - 1);
+	if(aligned_size > capacity)
+		return nullptr;
+
+	for(;;)
+	{
+		retire_transfers(false);
+
+		size_t begin = SIZE_MAX;
+		if(m_staging_region_deque.empty())
+		{
+			m_staging_head = 0;
+			begin = 0;
+		}
+		else
+		{
+			const size_t tail = m_staging_region_deque.front().begin;
+			if(m_staging_head > tail)
+			{
+				//live data is in [tail, head), try the end of the ring then wrap around to the start
+				if(capacity - m_staging_head >= aligned_size)
+					begin = m_staging_head;
+				else if(aligned_size <= tail)
+					begin = 0;
+			}
+			else if(tail - m_staging_head >= aligned_size)
+				begin = m_staging_head;
+		}
+
+		if(begin != SIZE_MAX)
+		{
+			m_staging_region_deque.push_back({ begin, begin + aligned_size, m_t_submit_count + 1 });
+			m_staging_head = begin + aligned_size;
+			*offset = begin;
+			return (char*)m_staging_buf.mapped + begin;
+		}
+
+		if(m_staging_region_deque.front().submit_id > m_t_submit_count)
+		{
+			//the ring is full of the batch we are still recording, flush it so its space can be reused
+			//m_t_cmd_buf is begun again, so the caller's command buffer handle stays valid
+			submit_transfer();
+			begin_transfer();
+		}
+		else
+			retire_transfers(true);
+	}
 }
\ No newline at end of file
@@ -1,54 +1,271 @@
 #pragma once
 #include "vma.h"
+#include "bvh.h"
+#include "scene.h"
 
+#include <atomic>
 #include <cstdint>
 #include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <thread>
 #include <vector>
 #include <vulkan/vulkan.h>
 
 struct Buffer
 {
 	VkBuffer handle = VK_NULL_HANDLE;
-	VmaAllocation alloc;
+	VmaAllocation alloc = VK_NULL_HANDLE;
 	size_t size;
+	void* mapped = nullptr; //only set for host visible buffers, which stay mapped for their whole lifetime
 };
 
+//matches the std140 Params block in common.glsl, fixed for the whole job
+struct RenderParams
+{
+	uint32_t width;
+	uint32_t height;
+	uint32_t sphere_count;
+	uint32_t light_count;
+	uint32_t path_capacity;
+	uint32_t pad[3];
+};
+
+//matches the push_constant block in common.glsl, everything that can change between dispatches
+struct PushConstants
+{
+	CameraFrame camera;
+	uint32_t sample_idx;
+	uint32_t seed;
+	uint32_t tile_origin[2];
+	uint32_t stats_slot;
+	uint32_t bounce; //wavefront only, from here on
+	uint32_t tile_size[2];
+	uint32_t path_count;
+	uint32_t pad;
+};
+
+//megakernel traces a whole path per invocation in path.comp
+//wavefront keeps every path of a tile in memory and advances them one bounce at a time through separate kernels,
+//so lanes of a dispatch all run the same stage instead of diverging on material
+enum Integrator
+{
+	INTEGRATOR_MEGAKERNEL,
+	INTEGRATOR_WAVEFRONT,
+};
+
+enum WavefrontStage
+{
+	WF_GENERATE,
+	WF_EXTEND,
+	WF_SHADE,
+	WF_COMPACT,
+	WF_CONNECT,
+	WF_STAGE_COUNT,
+};
+
+//values for the specialization constants of the kernels, in constant_id order
+struct KernelVariant
+{
+	uint32_t local_size_x;
+	uint32_t local_size_y;
+	uint32_t max_bounces;
+	VkBool32 use_metal;
+	VkBool32 use_dielectric;
+};
+
+//a slice of the staging ring, owned by the transfer submission that reads it
+struct StagingRegion
+{
+	size_t begin;
+	size_t end;
+	uint64_t submit_id;
+};
+
+//a buffer that is destroyed once the transfer submission with the given id has completed
+struct DeferredBuffer
+{
+	Buffer buf;
+	uint64_t submit_id;
+};
+
+//one destination range of an upload batch, data has to stay valid until the batch is recorded
+struct UploadRange
+{
+	Buffer* buf;
+	const void* data;
+	size_t size;
+	size_t dst_offset;
+};
+
+struct TransferStats
+{
+	uint64_t submit_count;
+	uint64_t complete_count;
+	double gpu_ms; //total gpu time of timed copies, 0 if the transfer queue can't write timestamps
+	size_t pending_reclaim_bytes; //device memory waiting for its transfer to finish before it is freed
+	size_t pending_reclaim_count;
+	size_t reclaimed_bytes; //running total freed since init
+	size_t direct_bytes; //written straight into mapped device local memory, without a transfer
+};
+
+//buffers are grouped into vma pools by how long they live, so short lived ones never fragment the blocks of long lived ones
+enum MemoryPool
+{
+	POOL_DEFAULT, //vma's own heaps, for anything without a pool of its own
+	POOL_SCENE, //uploaded once and kept until quit
+	POOL_FRAME, //scratch rewritten by every pass, freed all at once when it is resized
+	POOL_STAGING, //host memory for the staging ring, nothing else
+	POOL_COUNT,
+};
+
+struct PoolStats
+{
+	const char* name;
+	size_t block_count;
+	size_t allocation_count;
+	VkDeviceSize size; //device memory held by the pool's blocks
+	VkDeviceSize used;
+	VkDeviceSize largest_free; //the biggest allocation that still fits without a new block
+};
+
+//gpu timing of one tile submission, read back a frame late so it never stalls the pipeline
+struct PassStats
+{
+	uint64_t pass_idx;
+	uint32_t sample_idx;
+	uint32_t tile[4]; //x, y, width, height
+	uint32_t dispatch_count;
+	uint64_t sample_count; //one per pixel traced
+	uint64_t ray_count;
+	double gpu_ms;
+	double samples_per_sec;
+	double rays_per_sec;
+};
+
+//number of tile submissions that can be in flight on each compute queue at once
+constexpr uint32_t frames_in_flight = 2;
+
+//tiles are spread over up to this many queues of the compute family, each with frames_in_flight slots of its own
+constexpr uint32_t max_compute_queues = 8;
+constexpr uint32_t max_slots = frames_in_flight * max_compute_queues;
+
+
+//true if the vulkan loader is there and has at least one physical device, otherwise only the cpu backend can render
+bool vulkan_available();
+
 
 class Renderer
 {
 public:
-	Renderer(const char* render_name, int width, int height, bool display_live = false);
+	Renderer(const char* render_name, int width, int height, bool display_live = false, Integrator integrator = INTEGRATOR_MEGAKERNEL);
 	~Renderer();
 
 	void init();
 	void quit();
 
 	void render_frame();
+	bool render_tile();
+	void set_camera(const Camera& camera);
+	void set_tile_budget(double ms);
+
+	//for splitting one image over several renderers, see MultiRenderer
+	void set_region(uint32_t row_begin, uint32_t row_end);
+	void set_seed(uint32_t seed);
+	void set_device(uint32_t pdev_idx);
+	uint32_t device_count() const;
+
+	bool save_image(const char* path);
+	bool read_accum(float* dst);
+
+	TransferStats transfer_stats() const;
+	PoolStats pool_stats(MemoryPool pool) const;
+	PassStats last_pass_stats() const;
 
 private:
 	const char* const m_render_name;
 	const int m_width;
 	const int m_height;
 	const bool m_display_live;
+	const Integrator m_integrator;
+
+	//set on renderers driven by another one, pins their device and keeps them out of the caches and logs
+	int m_pinned_pdev_idx = -1;
 
 //init funcs
 private:
 	void create_instance();
 	void choose_pdev();
+	double benchmark_pdev(VkPhysicalDevice pdev, uint32_t pdev_idx);
 	void choose_queue_families();
 	void create_device();
 	void create_allocator();
 	void create_command_pools();
 	void create_command_buffers();
+	void create_pipeline_cache();
+	void save_pipeline_cache();
+	VkShaderModule create_shader_module(const char* name);
+	void choose_kernel_variant();
+	VkPipeline create_compute_pipeline(const char* name, const KernelVariant& variant);
 	void create_pipeline();
+	void create_wavefront_resources();
+	bool create_path_queues(uint32_t capacity);
+	void destroy_path_queues();
+	void create_frame_resources();
+	void upload_scene();
+	void write_descriptor_sets();
 
 
 
 //memory/transfer funcs
 private:
-	bool create_buffer(Buffer* buf, const size_t size);
+	bool create_buffer(Buffer* buf, const size_t size, 
+		VkBufferUsageFlags usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, 
+		VmaMemoryUsage mem_usage = VMA_MEMORY_USAGE_GPU_ONLY, bool concurrent = false, VmaAllocationCreateFlags alloc_flags = 0, 
+		MemoryPool pool = POOL_DEFAULT);
+	bool create_pool(MemoryPool pool, VkBufferUsageFlags usage, VmaMemoryUsage mem_usage, VmaPoolCreateFlags flags, VkDeviceSize block_size, 
+		VkMemoryPropertyFlags required_flags = 0);
+	bool has_direct_upload_memory();
+	void destroy_pool(MemoryPool pool);
 	void destroy_buffer(Buffer* buf);
+	void destroy_buffer_after_transfer(const Buffer& buf);
 	bool copy_to_buffer(VkCommandBuffer cmd_buf, Buffer* buf, const void* data, const size_t size);
+	bool add_upload(Buffer* buf, const void* data, const size_t size, const size_t dst_offset = 0);
+	bool record_uploads(VkCommandBuffer cmd_buf);
+	bool submit_uploads();
+
+	void device_memory_budget(VkDeviceSize* budget, VkDeviceSize* usage);
+	VkDeviceSize device_memory_available();
+	void check_memory_budget();
+
+	VkCommandBuffer begin_transfer();
+	void submit_transfer();
+	void retire_transfers(bool wait);
+
+
+//readback funcs
+private:
+	bool create_readback_resources();
+	bool export_accum(const std::function<void(const float*)>& consume);
+	void destroy_readback_resources();
+
+
+//profiling funcs
+private:
+	void create_profiler();
+	void destroy_profiler();
+	void collect_pass_stats(uint32_t slot);
+	void collect_transfer_stats();
+
+	void create_staging_ring();
+	void* alloc_staging(const size_t size, size_t* offset);
+
+	uint64_t choose_tile_pixels();
+	void record_dispatch(VkCommandBuffer cmd_buf, uint32_t slot, uint32_t group_count_x, uint32_t group_count_y, 
+		const Buffer* indirect_buf = nullptr, VkDeviceSize indirect_offset = 0);
+	void record_wavefront(VkCommandBuffer cmd_buf, uint32_t slot, PushConstants* push);
+	void wait_for_tiles();
 
 
 
@@ -58,33 +275,149 @@ private:
 
 private:
 	VkInstance m_instance;
+	uint32_t m_instance_api_version = VK_API_VERSION_1_0;
 	VkPhysicalDevice m_pdev;
+	VkPhysicalDeviceProperties m_pdev_props;
 
 	uint32_t m_c_queue_idx;
 	uint32_t m_t_queue_idx;
 
 	VkDevice m_dev;
-	VkQueue m_c_queue;
+	uint32_t m_c_queue_count = 1;
+	VkQueue m_c_queue_array[max_compute_queues];
 	VkQueue m_t_queue;
 
 	VmaAllocator m_vma;
+	bool m_has_memory_budget = false;
+	bool m_direct_upload = false; //scene buffers live in mapped device local memory and are written without a copy
+	VmaPool m_pool_array[POOL_COUNT] = {}; //POOL_DEFAULT stays null
 
 
-	VkCommandPool m_c_cmd_pool;
+	VkCommandPool m_c_cmd_pool_array[max_compute_queues];
 	VkCommandPool m_t_cmd_pool;
 
+	//slot i is submitted to compute queue i % m_c_queue_count, so consecutive tiles go to different queues
+	uint32_t m_slot_count = frames_in_flight;
 	VkCommandBuffer m_t_cmd_buf;
-	VkCommandBuffer m_c_cmd_buf_array[2];
+	VkCommandBuffer m_c_cmd_buf_array[max_slots];
+
+	VkFence m_t_fence;
+	VkFence m_c_fence_array[max_slots];
+
+	//every transfer submission signals one per compute queue, and the next tile on that queue waits for it,
+	//so uploads are ordered before the passes that read them without the host waiting for either
+	VkSemaphore m_t_semaphore_array[max_compute_queues];
+	bool m_t_semaphore_pending_array[max_compute_queues] = {}; //signalled, or about to be, and not waited on yet
 
+	//the other way around, a transfer waits for the tiles already on a compute queue before overwriting what they read
+	//signalled by an empty submission on that queue, only when it has had tiles since the last one
+	VkSemaphore m_c_semaphore_array[max_compute_queues];
+	bool m_c_queue_used_array[max_compute_queues] = {};
 
+
+	VkPipelineCache m_pipeline_cache;
 	VkDescriptorPool m_descriptor_pool;
 	VkDescriptorSetLayout m_dset_layout;
 	VkPipelineLayout m_pipeline_layout;
-	VkPipeline m_compute_pipeline;
+	VkPipeline m_compute_pipeline = VK_NULL_HANDLE;
+	KernelVariant m_kernel_variant;
+	VkDescriptorSet m_dset;
+
+	//one pipeline per stage, all sharing m_pipeline_layout and m_dset, 1d workgroups over the path queue
+	VkPipeline m_wf_pipeline_array[WF_STAGE_COUNT] = {};
+	KernelVariant m_wf_variant;
+	uint32_t m_wf_path_capacity = 0; //paths the queues have room for, the most pixels a tile can cover
+	Buffer m_path_buf;
+	Buffer m_ray_queue_buf;
+	Buffer m_hit_buf;
+	Buffer m_shadow_queue_buf;
+	Buffer m_light_buf;
+	Buffer m_count_buf; //queue lengths and the indirect dispatches sized by them, written only by the kernels
+
+
+	Scene m_scene;
+	Buffer m_scene_buf;
+	std::vector<BvhNode> m_bvh_node_vec;
+	Buffer m_bvh_buf;
+	Buffer m_sphere_geom_buf; //vec4 center and radius per sphere, see common.glsl
+	Buffer m_accum_buf;
+	Buffer m_params_buf;
+	CameraFrame m_camera_frame;
+
+	//number of tile submissions so far, modulo m_slot_count it picks the slot
+	uint64_t m_frame_idx = 0;
+	bool m_accum_reset = true;
+
+	//a sweep traces one sample for every pixel, as a raster of bands that are split into tiles if a whole band is too slow
+	uint32_t m_sample_idx = 0;
+	uint32_t m_tile_cursor[2] = {};
+	uint32_t m_region[2] = {}; //rows [begin, end) that sweeps cover, the whole image unless set_region narrows it
+	uint32_t m_seed = 0x9e3779b9;
+	uint32_t m_band_h = 0;
+
+	//tiles are sized so each submission takes about this long, well under the driver watchdog
+	double m_tile_budget_ms;
+	double m_ms_per_pixel = 0.0; //from the timestamps of finished submissions, 0 until the first one is measured
+	uint64_t m_last_tile_pixels = 0;
 
 
 private:
-	std::vector<Buffer> m_destroy_after_transfer_vec;
+	//ordered by submit id, so reclaiming only ever looks at the front
+	std::deque<DeferredBuffer> m_destroy_after_transfer_deque;
+	size_t m_pending_reclaim_bytes = 0;
+	size_t m_reclaimed_bytes = 0;
+
+	//uploads are sub-allocated from one persistently mapped ring instead of a new buffer each
+	Buffer m_staging_buf;
+	size_t m_staging_head = 0;
+	std::deque<StagingRegion> m_staging_region_deque;
+
+	//ranges gathered by add_upload, packed into one staging slice and recorded together
+	std::vector<UploadRange> m_upload_vec;
+	size_t m_direct_upload_bytes = 0;
+
+	//the batch being recorded into m_t_cmd_buf gets id m_t_submit_count + 1
+	uint64_t m_t_submit_count = 0;
+	uint64_t m_t_complete_count = 0;
+
+
+private:
+	//exports copy the accumulation buffer to a snapshot on the compute queue, then to host memory on the transfer queue
+	//so tracing continues while the slow copy and the encoding happen
+	VkCommandPool m_r_cmd_pool = VK_NULL_HANDLE;
+	VkCommandBuffer m_r_cmd_buf;
+	VkCommandBuffer m_c_snapshot_cmd_buf;
+	VkSemaphore m_snapshot_semaphore;
+	VkFence m_r_fence;
+	Buffer m_snapshot_buf; //left out when it doesn't fit the budget, the compute queue then copies straight to m_readback_buf
+	Buffer m_readback_buf;
+	std::thread m_writer_thread;
+	std::atomic<bool> m_writer_done; //set as the writer's last step, a finished writer is still joinable until someone joins it
+
+
+private:
+	//timestamp queries, one range per frame slot for compute and one for the transfer batch
+	//either pool is null if its queue family can't write timestamps
+	VkQueryPool m_c_query_pool = VK_NULL_HANDLE;
+	VkQueryPool m_t_query_pool = VK_NULL_HANDLE;
+	uint64_t m_c_timestamp_mask = 0;
+	uint64_t m_t_timestamp_mask = 0;
+
+	uint32_t m_c_query_count_array[max_slots] = {};
+	uint64_t m_slot_pass_idx_array[max_slots] = {};
+	uint64_t m_slot_sample_count_array[max_slots] = {};
+	uint32_t m_slot_sample_idx_array[max_slots] = {};
+	uint32_t m_slot_tile_array[max_slots][4] = {};
+
+	uint32_t m_t_query_count = 0;
+	uint32_t m_t_copy_count = 0;
+	size_t m_t_copy_bytes = 0;
+	double m_t_gpu_ms = 0.0;
+
+	//one ray counter per frame slot, written by the kernel and read by the host
+	Buffer m_stats_buf;
+	PassStats m_last_pass_stats = {};
+	FILE* m_profile_log = nullptr;
 
 
 
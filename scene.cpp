@@ -0,0 +1,214 @@
+#include "scene.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+
+static Sphere
+make_sphere(float x, float y, float z, float radius, MaterialType material, float r, float g, float b, float param = 0.0f)
+{
+	Sphere s;
+	s.center[0] = x;
+	s.center[1] = y;
+	s.center[2] = z;
+	s.radius = radius;
+	s.albedo[0] = r;
+	s.albedo[1] = g;
+	s.albedo[2] = b;
+	s.material = material;
+	s.emission[0] = 0.0f;
+	s.emission[1] = 0.0f;
+	s.emission[2] = 0.0f;
+	s.param = param;
+	return s;
+}
+
+static void
+build_sphere_scene(Scene* scene)
+{
+	Camera& cam = scene->camera;
+	cam.origin[0] = 0.0f;  cam.origin[1] = 1.0f;  cam.origin[2] = 4.0f;
+	cam.look_at[0] = 0.0f; cam.look_at[1] = 0.5f; cam.look_at[2] = 0.0f;
+	cam.up[0] = 0.0f;      cam.up[1] = 1.0f;      cam.up[2] = 0.0f;
+	cam.vfov = 40.0f;
+
+	scene->max_bounces = 8;
+
+	std::vector<Sphere>& vec = scene->sphere_vec;
+	vec.clear();
+
+	vec.push_back(make_sphere(0.0f, -1000.0f, 0.0f, 1000.0f, MATERIAL_DIFFUSE, 0.5f, 0.5f, 0.5f));
+	vec.push_back(make_sphere(-1.1f, 0.5f, 0.0f, 0.5f, MATERIAL_DIFFUSE, 0.8f, 0.3f, 0.2f));
+	vec.push_back(make_sphere(0.0f, 0.5f, 0.0f, 0.5f, MATERIAL_DIELECTRIC, 1.0f, 1.0f, 1.0f, 1.5f));
+	vec.push_back(make_sphere(1.1f, 0.5f, 0.0f, 0.5f, MATERIAL_METAL, 0.8f, 0.8f, 0.9f, 0.05f));
+
+	Sphere light = make_sphere(0.0f, 4.0f, 1.0f, 1.0f, MATERIAL_DIFFUSE, 0.0f, 0.0f, 0.0f);
+	light.emission[0] = 6.0f;
+	light.emission[1] = 6.0f;
+	light.emission[2] = 5.5f;
+	vec.push_back(light);
+}
+
+//pcg, only so the particles come out the same every run
+static float
+scene_rand(uint32_t* state)
+{
+	*state = *state * 747796405u + 2891336453u;
+	uint32_t word = ((*state >> ((*state >> 28u) + 4u)) ^ *state) * 277803737u;
+	word = (word >> 22u) ^ word;
+	return float(word >> 8) * (1.0f / 16777216.0f);
+}
+
+//a cloud of small spheres over the floor of the sphere scene, RP_PARTICLE_COUNT of them, a million by default
+//the radius shrinks with the count so the cloud is about as dense at any size, only the number of tiny spheres grows
+static void
+build_particle_scene(Scene* scene)
+{
+	Camera& cam = scene->camera;
+	cam.origin[0] = 0.0f;  cam.origin[1] = 1.5f;  cam.origin[2] = 5.0f;
+	cam.look_at[0] = 0.0f; cam.look_at[1] = 0.9f; cam.look_at[2] = 0.0f;
+	cam.up[0] = 0.0f;      cam.up[1] = 1.0f;      cam.up[2] = 0.0f;
+	cam.vfov = 40.0f;
+
+	scene->max_bounces = 8;
+
+	uint32_t particle_count = 1u << 20;
+	if(const char* env = getenv("RP_PARTICLE_COUNT"))
+		particle_count = (uint32_t)strtoul(env, nullptr, 10);
+
+	std::vector<Sphere>& vec = scene->sphere_vec;
+	vec.clear();
+	vec.reserve(particle_count + 2);
+
+	vec.push_back(make_sphere(0.0f, -1000.0f, 0.0f, 1000.0f, MATERIAL_DIFFUSE, 0.5f, 0.5f, 0.5f));
+
+	Sphere light = make_sphere(0.0f, 5.0f, 1.0f, 1.0f, MATERIAL_DIFFUSE, 0.0f, 0.0f, 0.0f);
+	light.emission[0] = 8.0f;
+	light.emission[1] = 8.0f;
+	light.emission[2] = 7.5f;
+	vec.push_back(light);
+
+	const float box_min[3] = { -2.0f, 0.1f, -1.5f };
+	const float box_max[3] = { 2.0f, 1.9f, 1.5f };
+	const float volume = (box_max[0] - box_min[0]) * (box_max[1] - box_min[1]) * (box_max[2] - box_min[2]);
+	const float radius = particle_count > 0 ? 0.25f * cbrtf(volume / particle_count) : 0.0f;
+
+	uint32_t rng_state = 0x2545f491;
+	for(uint32_t i = 0; i < particle_count; i++)
+	{
+		float p[3];
+		for(int a = 0; a < 3; a++)
+			p[a] = box_min[a] + scene_rand(&rng_state) * (box_max[a] - box_min[a]);
+		const float r = radius * (0.5f + scene_rand(&rng_state));
+
+		const float kind = scene_rand(&rng_state);
+		const float cr = scene_rand(&rng_state);
+		const float cg = scene_rand(&rng_state);
+		const float cb = scene_rand(&rng_state);
+		if(kind < 0.8f)
+			vec.push_back(make_sphere(p[0], p[1], p[2], r, MATERIAL_DIFFUSE, cr * cr, cg * cg, cb * cb));
+		else if(kind < 0.95f)
+			vec.push_back(make_sphere(p[0], p[1], p[2], r, MATERIAL_METAL, 0.5f + 0.5f * cr, 0.5f + 0.5f * cg, 0.5f + 0.5f * cb, 0.2f * cr));
+		else
+			vec.push_back(make_sphere(p[0], p[1], p[2], r, MATERIAL_DIELECTRIC, 1.0f, 1.0f, 1.0f, 1.5f));
+	}
+}
+
+
+bool
+load_scene(const char* name, Scene* scene)
+{
+	if(strcmp(name, "Sphere") == 0)
+	{
+		build_sphere_scene(scene);
+		return true;
+	}
+	if(strcmp(name, "Particles") == 0)
+	{
+		build_particle_scene(scene);
+		return true;
+	}
+
+	fprintf(stderr, "unknown scene \"%s\"!\n", name);
+	return false;
+}
+
+bool
+scene_uses_material(const Scene& scene, MaterialType material)
+{
+	for(const Sphere& s : scene.sphere_vec)
+	{
+		if(s.material == material)
+			return true;
+	}
+	return false;
+}
+
+//indices of every sphere that emits light, for sampling them directly
+void
+scene_lights(const Scene& scene, std::vector<uint32_t>* light_vec)
+{
+	light_vec->clear();
+	for(uint32_t i = 0; i < scene.sphere_vec.size(); i++)
+	{
+		const float* e = scene.sphere_vec[i].emission;
+		if(e[0] > 0.0f || e[1] > 0.0f || e[2] > 0.0f)
+			light_vec->push_back(i);
+	}
+}
+
+
+static void
+normalize(float v[3])
+{
+	float len = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	v[0] /= len;
+	v[1] /= len;
+	v[2] /= len;
+}
+
+static void
+cross(const float a[3], const float b[3], float out[3])
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+void
+make_camera_frame(const Camera& camera, int width, int height, CameraFrame* frame)
+{
+	const float aspect = (float)width / (float)height;
+	const float half_h = tanf(camera.vfov * 0.5f * 3.14159265f / 180.0f);
+	const float half_w = aspect * half_h;
+
+	//w points backwards, out of the screen
+	float w[3] = {
+		camera.origin[0] - camera.look_at[0],
+		camera.origin[1] - camera.look_at[1],
+		camera.origin[2] - camera.look_at[2],
+	};
+	normalize(w);
+
+	float u[3];
+	cross(camera.up, w, u);
+	normalize(u);
+
+	float v[3];
+	cross(w, u, v);
+
+	for(int i = 0; i < 3; i++)
+	{
+		frame->origin[i] = camera.origin[i];
+		frame->horizontal[i] = 2.0f * half_w * u[i];
+		frame->vertical[i] = 2.0f * half_h * v[i];
+		frame->lower_left[i] = camera.origin[i] - half_w * u[i] - half_h * v[i] - w[i];
+	}
+
+	frame->origin[3] = 0.0f;
+	frame->horizontal[3] = 0.0f;
+	frame->vertical[3] = 0.0f;
+	frame->lower_left[3] = 0.0f;
+}
\ No newline at end of file
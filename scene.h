@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+enum MaterialType : uint32_t
+{
+	MATERIAL_DIFFUSE = 0,
+	MATERIAL_METAL = 1,
+	MATERIAL_DIELECTRIC = 2,
+};
+
+//matches the std430 layout of Sphere in path.comp, so it can be uploaded as is
+struct Sphere
+{
+	float center[3];
+	float radius;
+	float albedo[3];
+	uint32_t material;
+	float emission[3];
+	float param; //fuzz for metal, index of refraction for dielectric
+};
+
+struct Camera
+{
+	float origin[3];
+	float look_at[3];
+	float up[3];
+	float vfov; //degrees
+};
+
+//the pinhole camera expanded into what the kernel needs to generate primary rays
+//vec4s so that it can be embedded directly into std140 blocks
+struct CameraFrame
+{
+	float origin[4];
+	float lower_left[4];
+	float horizontal[4];
+	float vertical[4];
+};
+
+struct Scene
+{
+	Camera camera;
+	uint32_t max_bounces;
+	std::vector<Sphere> sphere_vec;
+};
+
+bool scene_uses_material(const Scene& scene, MaterialType material);
+void scene_lights(const Scene& scene, std::vector<uint32_t>* light_vec);
+
+bool load_scene(const char* name, Scene* scene);
+void make_camera_frame(const Camera& camera, int width, int height, CameraFrame* frame);
\ No newline at end of file
@@ -0,0 +1,33 @@
+#include "shaders.h"
+
+#include <cstring>
+
+//generated by the makefile with glslangValidator --vn, each defines a uint32_t array named after its source file
+#include "path.comp.inc"
+#include "wf_generate.comp.inc"
+#include "wf_extend.comp.inc"
+#include "wf_shade.comp.inc"
+#include "wf_compact.comp.inc"
+#include "wf_connect.comp.inc"
+
+
+static const ShaderBinary shader_table[] = {
+	{ "path.comp", path_comp_spv, sizeof(path_comp_spv) },
+	{ "wf_generate.comp", wf_generate_comp_spv, sizeof(wf_generate_comp_spv) },
+	{ "wf_extend.comp", wf_extend_comp_spv, sizeof(wf_extend_comp_spv) },
+	{ "wf_shade.comp", wf_shade_comp_spv, sizeof(wf_shade_comp_spv) },
+	{ "wf_compact.comp", wf_compact_comp_spv, sizeof(wf_compact_comp_spv) },
+	{ "wf_connect.comp", wf_connect_comp_spv, sizeof(wf_connect_comp_spv) },
+};
+
+
+const ShaderBinary*
+find_shader(const char* name)
+{
+	for(const ShaderBinary& shader : shader_table)
+	{
+		if(strcmp(shader.name, name) == 0)
+			return &shader;
+	}
+	return nullptr;
+}
\ No newline at end of file
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+//spir-v compiled from the glsl kernels at build time and linked into the binary
+struct ShaderBinary
+{
+	const char* name; //source file name, e.g. "path.comp"
+	const uint32_t* code;
+	size_t size; //bytes
+};
+
+const ShaderBinary* find_shader(const char* name);
\ No newline at end of file
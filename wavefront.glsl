@@ -0,0 +1,132 @@
+//state shared by the wavefront stages, each stage is a separate dispatch over the ray or shadow queue
+//the ray queue is double buffered by bounce parity, shade marks ended paths INVALID_PATH in place
+//and compact packs the survivors densely into the other half, so the next bounce only launches live paths
+
+#define INVALID_PATH 0xffffffffu
+#define NO_HIT 0xffffffffu
+#define PATH_SPECULAR 1u //the last bounce was not diffuse, so hitting an emitter counts, nee didn't see it
+
+struct PathState
+{
+	vec3 throughput;
+	uint pixel;
+	vec3 radiance;
+	uint rng;
+	uint flags;
+	uint pad0;
+	uint pad1;
+	uint pad2;
+};
+
+struct Ray
+{
+	vec3 origin;
+	uint path;
+	vec3 dir;
+	uint pad;
+};
+
+struct Hit
+{
+	float t;
+	uint sphere;
+};
+
+//a light sample for next event estimation, contrib is added to the path if nothing blocks it
+//finish is set if the path ended at the bounce that produced the sample, connect then accumulates it
+struct ShadowRay
+{
+	vec3 origin;
+	uint path;
+	vec3 dir;
+	uint light;
+	vec3 contrib;
+	uint finish;
+};
+
+layout(std430, set = 0, binding = 4) buffer PathBuffer
+{
+	PathState paths[];
+};
+
+//two halves of params.path_capacity rays, bounce parity picks the one being read
+layout(std430, set = 0, binding = 5) buffer RayQueue
+{
+	Ray ray_queue[];
+};
+
+layout(std430, set = 0, binding = 6) buffer HitBuffer
+{
+	Hit hits[];
+};
+
+//first half indexed like the ray queue as shade writes it, second half packed by compact for connect
+layout(std430, set = 0, binding = 7) buffer ShadowQueue
+{
+	ShadowRay shadow_queue[];
+};
+
+//indices of the emissive spheres, params.light_count of them
+layout(std430, set = 0, binding = 8) readonly buffer LightBuffer
+{
+	uint lights[];
+};
+
+//queue lengths per bounce parity, each preceded by the VkDispatchIndirectCommand that covers it
+//group counts never drop below 1, so a dispatch over an empty queue still runs the lane that resets the next counts
+struct QueueCounts
+{
+	uint ray_groups_x;
+	uint ray_groups_y;
+	uint ray_groups_z;
+	uint ray_count;
+	uint shadow_groups_x;
+	uint shadow_groups_y;
+	uint shadow_groups_z;
+	uint shadow_count;
+};
+
+layout(std430, set = 0, binding = 9) buffer CountBuffer
+{
+	QueueCounts counts[2];
+};
+
+
+uint
+cur_queue()
+{
+	return pc.bounce & 1u;
+}
+
+uint
+next_queue()
+{
+	return cur_queue() ^ 1u;
+}
+
+uint
+ray_slot(uint queue, uint k)
+{
+	return queue * params.path_capacity + k;
+}
+
+
+void
+finish_path(PathState state)
+{
+	accum[state.pixel] += vec4(state.radiance, 1.0);
+}
+
+//empty queues, written by the stage before the one that fills them
+void
+reset_counts(uint queue)
+{
+	counts[queue].ray_groups_x = 1u;
+	counts[queue].ray_groups_y = 1u;
+	counts[queue].ray_groups_z = 1u;
+	counts[queue].ray_count = 0u;
+	counts[queue].shadow_groups_x = 1u;
+	counts[queue].shadow_groups_y = 1u;
+	counts[queue].shadow_groups_z = 1u;
+	counts[queue].shadow_count = 0u;
+}
\ No newline at end of file